@@ -0,0 +1,121 @@
+#include "ass4.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <new>
+#include <string>
+#include <vector>
+#include "expression_tree.h"
+#include "evaluator.h"
+using namespace std;
+
+//
+// The C interface of ass4.h, a thin layer over LinkedBinaryTree and CompiledExpression.
+// Exceptions must not cross into C, so each entry point catches everything and reports it as
+// an error instead.
+
+struct ass4_tree {
+    LinkedBinaryTree tree;
+};
+
+struct ass4_program {
+    CompiledExpression code;
+};
+
+// Hands a message to the caller as a malloc'd string (if they asked for one).
+static void setError(char** error, const string& message) {
+    if (error == nullptr)
+        return;
+    *error = (char*)malloc(message.size() + 1);
+    if (*error != nullptr)
+        memcpy(*error, message.c_str(), message.size() + 1);
+}
+
+ass4_tree* ass4_parse(const char* postfix, const char* const* columns, size_t ncolumns, char** error) {
+    if (error != nullptr)
+        *error = nullptr;
+    try {
+        vector<string> names(columns, columns + ncolumns);
+        ass4_tree* result = new ass4_tree;
+        string message;
+        if (!parseExpressionTree(postfix, names, result->tree, message)) {
+            delete result;
+            setError(error, message);
+            return nullptr;
+        }
+        return result;
+    } catch (const exception& e) {
+        setError(error, e.what());
+        return nullptr;
+    }
+}
+
+size_t ass4_render(const ass4_tree* tree, char* buf, size_t size) {
+    try {
+        string text;
+        tree->tree.renderExpression(text);
+        if (size > 0) {
+            size_t len = min(text.size(), size - 1);
+            memcpy(buf, text.data(), len);
+            buf[len] = '\0';
+        }
+        return text.size();
+    } catch (const exception&) {
+        if (size > 0)
+            buf[0] = '\0';
+        return 0;
+    }
+}
+
+ass4_program* ass4_compile(const ass4_tree* tree, char** error) {
+    if (error != nullptr)
+        *error = nullptr;
+    try {
+        return new ass4_program{CompiledExpression(tree->tree)};
+    } catch (const exception& e) {
+        setError(error, e.what());
+        return nullptr;
+    }
+}
+
+void ass4_evaluate_batch(const ass4_program* program, const double* const* columns, size_t rows, double* out) {
+    try {
+        program->code.evaluateBatch(columns, rows, out);
+    } catch (const bad_alloc&) {
+        fill(out, out + rows, numeric_limits<double>::quiet_NaN());
+    }
+}
+
+// The columns are viewed in place, not copied.
+double ass4_score(const ass4_program* program, const double* const* columns, size_t ncolumns,
+                  size_t rows, const double* weights) {
+    try {
+        Dataset data;
+        data.columns.resize(max(ncolumns, (size_t)1));
+        vector<double> none(ncolumns == 0 ? rows : 0); // the row count is taken from the columns
+        for (size_t c = 0; c < data.columns.size(); c++)
+            data.columns[c].setView(ncolumns == 0 ? none.data() : columns[c], rows);
+        if (weights != nullptr) {
+            data.weights.assign(weights, weights + rows);
+            for (size_t i = 0; i < rows; i++)
+                data.weightTotal += weights[i];
+        }
+        return program->code.score(data);
+    } catch (const bad_alloc&) {
+        return numeric_limits<double>::quiet_NaN();
+    }
+}
+
+void ass4_free_tree(ass4_tree* tree) {
+    delete tree;
+}
+
+void ass4_free_program(ass4_program* program) {
+    delete program;
+}
+
+void ass4_free_string(char* s) {
+    free(s);
+}
@@ -0,0 +1,55 @@
+#ifndef ASS4_H
+#define ASS4_H
+
+/*
+ * C interface to the ass4 expression library, for embedding the parser and the batch evaluator
+ * in other programs. Trees and compiled programs are opaque handles; every handle returned here
+ * is released with the matching free function. No function throws, and none writes to stdout or
+ * stderr: failures are reported through the return value and an error message (NaN results when
+ * evaluation runs out of memory).
+ *
+ * Columns are passed as an array of pointers, one per column name given to ass4_parse, each to
+ * `rows` doubles. A compiled program is never modified by evaluation, so one program may be
+ * evaluated from several threads at once.
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ass4_tree ass4_tree;       /* a parsed expression tree */
+typedef struct ass4_program ass4_program; /* a tree compiled for batch evaluation */
+
+/*
+ * Parses a postfix expression whose variables are the given column names. Returns NULL if the
+ * expression is invalid or names an unknown column; then, if error is not NULL, *error is set to
+ * a message that the caller releases with ass4_free_string.
+ */
+ass4_tree* ass4_parse(const char* postfix, const char* const* columns, size_t ncolumns, char** error);
+
+/* Writes the tree in infix form to buf as a NUL terminated string, truncated to size bytes.
+ * Returns the length of the full text, so a result >= size means buf was too small. */
+size_t ass4_render(const ass4_tree* tree, char* buf, size_t size);
+
+/* Compiles a tree for batch evaluation. Returns NULL (and sets *error as above) on failure. */
+ass4_program* ass4_compile(const ass4_tree* tree, char** error);
+
+/* Evaluates rows 0..rows-1, writing one value per row to out. */
+void ass4_evaluate_batch(const ass4_program* program, const double* const* columns, size_t rows, double* out);
+
+/* The score of the program: the average of its values over the rows, summed in row order as the
+ * Ass4 program does. weights may be NULL; otherwise row i counts weights[i] times. */
+double ass4_score(const ass4_program* program, const double* const* columns, size_t ncolumns,
+                  size_t rows, const double* weights);
+
+void ass4_free_tree(ass4_tree* tree);
+void ass4_free_program(ass4_program* program);
+void ass4_free_string(char* s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,179 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+#include "expression_tree.h"
+#include "pareto.h"
+using namespace std;
+
+//
+// Random cross-checks of the library's exact algorithms against slow direct computations.
+// Usage: Ass4Check [trees] [seed], where trees is the number of random trees simplified (a thirtieth
+// as many sets of records are ranked). Prints the first mismatch of each check and exits with 1
+// if there was any.
+
+static mt19937_64 rng;
+
+static size_t uniform(size_t n) {
+    return uniform_int_distribution<size_t>(0, n - 1)(rng);
+}
+
+//*****************************************************
+// Simplifier
+
+//
+// simplify must not change a tree's value on any row inside the domain it was given, NaN included.
+// With keepZeroSign false only the sign of a zero result may change. Random trees over a and b
+// are simplified for random domains and evaluated before and after on rows drawn from the domain:
+// its ends, signed zeros, NaN when the domain allows it, and values in between.
+
+static const double INF = numeric_limits<double>::infinity();
+
+// A random postfix expression of at most the given depth. Literals favour the values the
+// simplifier's rules look for.
+static string randomExpression(int depth) {
+    static const char* literals[] = {"0", "-0", "1", "-1", "2", "0.5", "-3", "1e308", "7.25"};
+    static const char* ops[] = {"+", "-", "*", "/", ">", "abs"};
+    if (depth <= 1 || uniform(3) == 0) {
+        if (uniform(2) == 0)
+            return uniform(2) == 0 ? "a" : "b";
+        return literals[uniform(sizeof(literals) / sizeof(literals[0]))];
+    }
+    string op = ops[uniform(6)];
+    if (op == "abs")
+        return randomExpression(depth - 1) + " abs";
+    return randomExpression(depth - 1) + " " + randomExpression(depth - 1) + " " + op;
+}
+
+static Interval randomDomain() {
+    static const double ends[] = {-INF, -1e300, -10, -1, -0.5, 0, 0.5, 1, 10, 1e300, INF};
+    size_t n = sizeof(ends) / sizeof(ends[0]);
+    double x = ends[uniform(n)], y = ends[uniform(n)];
+    return {min(x, y), max(x, y), uniform(4) == 0};
+}
+
+// Values of a column with the given domain, including both ends and both zeros when they are in it.
+static vector<double> domainValues(const Interval& d) {
+    vector<double> values = {d.lo, d.hi};
+    if (d.lo <= 0 && d.hi >= 0) {
+        values.push_back(0.0);
+        values.push_back(-0.0);
+    }
+    if (d.mayBeNaN)
+        values.push_back(numeric_limits<double>::quiet_NaN());
+    double lo = max(d.lo, -1e6), hi = min(d.hi, 1e6);
+    for (int i = 0; i < 4 && lo <= hi; i++)
+        values.push_back(uniform_real_distribution<double>(lo, hi)(rng));
+    return values;
+}
+
+static bool sameValue(double x, double y, bool keepZeroSign) {
+    if (isnan(x) || isnan(y))
+        return isnan(x) && isnan(y);
+    return x == y && (!keepZeroSign || signbit(x) == signbit(y));
+}
+
+static bool checkSimplify(size_t trees) {
+    const vector<string> columns = {"a", "b"};
+    for (size_t i = 0; i < trees; i++) {
+        string postfix = randomExpression(2 + uniform(5));
+        LinkedBinaryTree t;
+        string error;
+        if (!parseExpressionTree(postfix, columns, t, error)) {
+            cerr << "simplify: could not parse " << postfix << ": " << error << endl;
+            return false;
+        }
+        vector<Interval> domain = {randomDomain(), randomDomain()};
+        bool keepZeroSign = uniform(2) == 0;
+        LinkedBinaryTree simple = t;
+        simple.simplify(domain, keepZeroSign);
+        for (double a : domainValues(domain[0])) {
+            for (double b : domainValues(domain[1])) {
+                double row[2] = {a, b};
+                double before = t.evaluateExpression(row), after = simple.evaluateExpression(row);
+                if (!sameValue(before, after, keepZeroSign)) {
+                    cerr << "simplify: " << postfix << " became ";
+                    simple.printExpression(cerr);
+                    cerr << " (keepZeroSign " << keepZeroSign << ", a in [" << domain[0].lo << ", "
+                         << domain[0].hi << "], b in [" << domain[1].lo << ", " << domain[1].hi
+                         << "]); at a = " << a << ", b = " << b << " it gives " << after
+                         << " instead of " << before << endl;
+                    return false;
+                }
+            }
+        }
+    }
+    cerr << "simplify: " << trees << " random trees agree" << endl;
+    return true;
+}
+
+//*****************************************************
+// Pareto Fronts
+
+//
+// paretoFronts must give every record the front that peeling gives: front 0 is the records no
+// other record dominates, front 1 those no remaining record dominates once front 0 is removed,
+// and so on. Random sets of records with many ties on score and size, and some -infinity scores,
+// are compared against that O(N^2) peeling.
+
+static bool dominates(const ParetoRecord& q, const ParetoRecord& r) {
+    return q.score >= r.score && q.size <= r.size && (q.score > r.score || q.size < r.size);
+}
+
+static vector<uint32_t> peelFronts(const vector<ParetoRecord>& recs) {
+    vector<uint32_t> front(recs.size(), UINT32_MAX);
+    size_t left = recs.size();
+    for (uint32_t f = 0; left > 0; f++) {
+        vector<size_t> members;
+        for (size_t i = 0; i < recs.size(); i++) {
+            if (front[i] != UINT32_MAX)
+                continue;
+            bool dominated = false;
+            for (size_t j = 0; j < recs.size() && !dominated; j++)
+                dominated = front[j] == UINT32_MAX && dominates(recs[j], recs[i]);
+            if (!dominated)
+                members.push_back(i);
+        }
+        for (size_t i : members)
+            front[i] = f;
+        left -= members.size();
+    }
+    return front;
+}
+
+static bool checkPareto(size_t sets) {
+    for (size_t s = 0; s < sets; s++) {
+        size_t n = 1 + uniform(200);
+        size_t scores = 1 + uniform(20), sizes = 1 + uniform(20);
+        vector<ParetoRecord> recs(n);
+        for (size_t i = 0; i < n; i++) {
+            double score = uniform(10) == 0 ? -INF : double(uniform(scores)) - 5;
+            recs[i] = {score, uint32_t(1 + uniform(sizes)), uint32_t(i)};
+        }
+        vector<uint32_t> expected = peelFronts(recs);
+        vector<uint32_t> front = paretoFronts(recs);
+        for (size_t i = 0; i < n; i++) {
+            if (front[i] != expected[recs[i].index]) {
+                cerr << "pareto: record " << recs[i].index << " (score " << recs[i].score << ", size "
+                     << recs[i].size << ") of set " << s << " is in front " << front[i] << " instead of "
+                     << expected[recs[i].index] << endl;
+                return false;
+            }
+        }
+    }
+    cerr << "pareto: " << sets << " random sets agree" << endl;
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    size_t trees = argc > 1 ? strtoull(argv[1], nullptr, 10) : 100000;
+    rng.seed(argc > 2 ? strtoull(argv[2], nullptr, 10) : 1);
+    bool ok = checkSimplify(trees);
+    ok = checkPareto(max<size_t>(1, trees / 30)) && ok;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,283 @@
+#include "evaluator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <vector>
+using namespace std;
+
+//*****************************************************
+// Datasets
+
+// Adds the outputs for rows start..start+m-1 to sum, each as many times as its row occurred.
+// Without weights the outputs are simply added in row order.
+void addOutputs(const Dataset& data, size_t start, size_t m, const double* out, double& sum) {
+    if (data.weights.empty()) {
+        for (size_t i = 0; i < m; i++)
+            sum += out[i];
+    } else {
+        for (size_t i = 0; i < m; i++)
+            sum += data.weights[start + i] * out[i];
+    }
+}
+
+//*****************************************************
+// Compiled Expressions
+
+CompiledExpression::CompiledExpression(const LinkedBinaryTree& t) : maxDepth(0), inner(-1) {
+    compile(t, t._root, 1);
+}
+
+CompiledExpression::CompiledExpression(const LinkedBinaryTree& t, int _inner) : maxDepth(0), inner(_inner) {
+    compile(t, t._root, 1);
+}
+
+CompiledExpression::CompiledExpression(const LinkedBinaryTree& t, LinkedBinaryTree::Node* v) : maxDepth(0), inner(-1) {
+    compile(t, v, 1);
+}
+
+// Emits the code for the subtree rooted at v, whose value ends up at the given stack depth.
+void CompiledExpression::compile(const LinkedBinaryTree& t, LinkedBinaryTree::Node* v, int depth) {
+    maxDepth = max(maxDepth, depth);
+    // An operator whose subtree does not read the inner column has the same value on every row.
+    if (inner >= 0 && v != nullptr && (v->left != nullptr || v->right != nullptr) && !t.dependsOn(v, inner)) {
+        code.push_back({PUSH_SLOT, (int)hoisted.size(), 0});
+        hoisted.push_back(CompiledExpression(t, v));
+        return;
+    }
+    if (v == nullptr) {
+        code.push_back({PUSH_CONST, -1, 0});
+    } else if (v->left == nullptr && v->right == nullptr) {
+        if (v->var >= 0)
+            code.push_back({PUSH_VAR, v->var, 0});
+        else
+            code.push_back({PUSH_CONST, -1, std::stod(v->elt)});
+    } else if (v->elt == "abs") {
+        compile(t, v->left, depth);
+        code.push_back({ABS, -1, 0});
+    } else {
+        compile(t, v->left, depth);
+        compile(t, v->right, depth + 1);
+        if (v->elt == "+")
+            code.push_back({ADD, -1, 0});
+        else if (v->elt == "-")
+            code.push_back({SUB, -1, 0});
+        else if (v->elt == "*")
+            code.push_back({MUL, -1, 0});
+        else if (v->elt == "/")
+            code.push_back({DIV, -1, 0});
+        else if (v->elt == ">")
+            code.push_back({GT, -1, 0});
+        else
+            throw invalid_argument("unexpected operator " + v->elt);
+    }
+}
+
+void CompiledExpression::evaluateRange(const Dataset& data, size_t start, size_t n, double* out) const {
+    vector<const double*> columns(data.columns.size());
+    for (size_t c = 0; c < columns.size(); c++)
+        columns[c] = data.columns[c].data() + start;
+    evaluateBatch(columns.data(), n, out);
+}
+
+// Sums the outputs in row order, so the average matches main's loop bit for bit
+// (for a deduplicated dataset it is the weighted average).
+double CompiledExpression::score(const Dataset& data) const {
+    double out[BLOCK];
+    double sum = 0;
+    for (size_t start = 0; start < data.rows(); start += BLOCK) {
+        size_t m = min(BLOCK, data.rows() - start);
+        evaluateRange(data, start, m, out);
+        addOutputs(data, start, m, out, sum);
+    }
+    return sum / data.count();
+}
+
+//*****************************************************
+// Compressed Columns
+
+// Both encoding (to check the error) and decoding use this loop, so they agree on every value.
+void CompressedColumns::decodeCodes(const uint16_t* codes, double lo, double step, size_t m, double* out) {
+    for (size_t i = 0; i < m; i++)
+        out[i] = lo + codes[i] * step;
+}
+
+CompressedColumns::CompressedColumns(const Dataset& data, double maxError)
+    : blocks(data.columns.size()), codes(data.columns.size()), raw(data.columns.size()) {
+    double decoded[BLOCK];
+    uint16_t trial[BLOCK];
+    for (size_t c = 0; c < data.columns.size(); c++) {
+        const double* values = data.columns[c].data();
+        for (size_t start = 0; start < data.rows(); start += BLOCK) {
+            size_t m = min(BLOCK, data.rows() - start);
+            const double* x = values + start;
+            total++;
+            double lo = x[0], hi = x[0];
+            bool finite = true, integral = true;
+            for (size_t i = 0; i < m; i++) {
+                finite = finite && isfinite(x[i]);
+                integral = integral && x[i] == floor(x[i]);
+                lo = min(lo, x[i]);
+                hi = max(hi, x[i]);
+            }
+            // Try a step of 1 for integers, then the step that spreads the range over all codes.
+            bool fits = false;
+            double step = 0;
+            for (int attempt = 0; attempt < 2 && finite && !fits; attempt++) {
+                if (attempt == 0 && !(integral && hi - lo <= 65535))
+                    continue;
+                step = attempt == 0 ? 1 : (hi - lo) / 65535;
+                if (!(step > 0) || !isfinite(step))
+                    step = 1; // a constant block
+                for (size_t i = 0; i < m; i++)
+                    trial[i] = (uint16_t)min(65535.0, nearbyint((x[i] - lo) / step));
+                decodeCodes(trial, lo, step, m, decoded);
+                fits = true;
+                for (size_t i = 0; i < m && fits; i++)
+                    fits = fabs(decoded[i] - x[i]) <= maxError && signbit(decoded[i]) == signbit(x[i]);
+            }
+            if (fits) {
+                blocks[c].push_back({lo, step, codes[c].size()});
+                codes[c].insert(codes[c].end(), trial, trial + m);
+                quantized++;
+            } else {
+                blocks[c].push_back({0, 0, raw[c].size()});
+                raw[c].insert(raw[c].end(), x, x + m);
+            }
+        }
+    }
+}
+
+void CompressedColumns::decode(size_t c, size_t start, size_t m, double* out) const {
+    const Block& b = blocks[c][start / BLOCK];
+    if (b.step == 0)
+        copy(&raw[c][b.index], &raw[c][b.index] + m, out);
+    else
+        decodeCodes(&codes[c][b.index], b.lo, b.step, m, out);
+}
+
+double CompressedColumns::ratio() const {
+    size_t bytes = 0, rows = 0;
+    for (size_t c = 0; c < blocks.size(); c++) {
+        bytes += codes[c].size() * sizeof(uint16_t) + raw[c].size() * sizeof(double) + blocks[c].size() * sizeof(Block);
+        rows += codes[c].size() + raw[c].size();
+    }
+    return rows == 0 ? 1 : double(bytes) / (rows * sizeof(double));
+}
+
+// Scores the tree on the compressed columns, with the weights and row count of data.
+double CompiledExpression::scoreCompressed(const CompressedColumns& columns, const Dataset& data) const {
+    double out[BLOCK];
+    double sum = 0;
+    for (size_t start = 0; start < data.rows(); start += BLOCK) {
+        size_t m = min(BLOCK, data.rows() - start);
+        evaluateBlocks(m, out, (const double*)nullptr, [&](int var, size_t, size_t len, double* top) {
+            columns.decode(var, start, len, top);
+        });
+        addOutputs(data, start, m, out, sum);
+    }
+    return sum / data.count();
+}
+
+//*****************************************************
+// Gradients
+
+//
+// Reverse mode automatic differentiation over the compiled program. A forward pass over a block of
+// rows keeps the value every instruction produced; a backward pass then carries the derivative of
+// the score back from the last instruction to the operands of each one, adding up at the literals.
+// One pass over the rows thus gives the score and its derivative with respect to every literal.
+// abs is taken to have slope 1 at zero and > to have slope 0 (it is flat wherever it is defined).
+
+double CompiledExpression::scoreGradient(const Dataset& data, vector<double>& gradient) const {
+    if (inner >= 0)
+        throw logic_error("gradients of hoisted programs are not supported");
+    // Find the instructions producing the operands of each instruction.
+    size_t n = code.size();
+    vector<int> leftOf(n, -1), rightOf(n, -1), producers;
+    for (size_t i = 0; i < n; i++) {
+        if (code[i].op <= PUSH_SLOT) {
+            producers.push_back(i);
+            continue;
+        }
+        if (code[i].op != ABS) {
+            rightOf[i] = producers.back();
+            producers.pop_back();
+        }
+        leftOf[i] = producers.back();
+        producers.back() = i;
+    }
+    gradient.assign(count_if(code.begin(), code.end(), [](const Instr& in) { return in.op == PUSH_CONST; }), 0);
+
+    vector<double> val(n * BLOCK), adj(n * BLOCK);
+    double sum = 0;
+    for (size_t start = 0; start < data.rows(); start += BLOCK) {
+        size_t m = min(BLOCK, data.rows() - start);
+        for (size_t i = 0; i < n; i++) {
+            const Instr& in = code[i];
+            double* v = &val[i * BLOCK];
+            const double* l = leftOf[i] >= 0 ? &val[leftOf[i] * BLOCK] : nullptr;
+            const double* r = rightOf[i] >= 0 ? &val[rightOf[i] * BLOCK] : nullptr;
+            switch (in.op) {
+            case PUSH_VAR: copy(&data.columns[in.var][start], &data.columns[in.var][start] + m, v); break;
+            case PUSH_CONST: fill(v, v + m, in.value); break;
+            case ABS: for (size_t k = 0; k < m; k++) v[k] = (l[k] < 0) ? -l[k] : l[k]; break;
+            case ADD: for (size_t k = 0; k < m; k++) v[k] = l[k] + r[k]; break;
+            case SUB: for (size_t k = 0; k < m; k++) v[k] = l[k] - r[k]; break;
+            case MUL: for (size_t k = 0; k < m; k++) v[k] = l[k] * r[k]; break;
+            case DIV: for (size_t k = 0; k < m; k++) v[k] = l[k] / r[k]; break;
+            case GT:  for (size_t k = 0; k < m; k++) v[k] = (l[k] > r[k]) ? 1 : -1; break;
+            default: break;
+            }
+        }
+        const double* out = &val[(n - 1) * BLOCK];
+        addOutputs(data, start, m, out, sum);
+
+        // Each row's output enters the score with weight (row weight) / (row count).
+        fill(adj.begin(), adj.end(), 0);
+        double* a = &adj[(n - 1) * BLOCK];
+        for (size_t k = 0; k < m; k++)
+            a[k] = data.weight(start + k) / data.count();
+        size_t constant = gradient.size();
+        for (size_t i = n; i-- > 0; ) {
+            const Instr& in = code[i];
+            const double* g = &adj[i * BLOCK];
+            const double* v = &val[i * BLOCK];
+            double* gl = leftOf[i] >= 0 ? &adj[leftOf[i] * BLOCK] : nullptr;
+            double* gr = rightOf[i] >= 0 ? &adj[rightOf[i] * BLOCK] : nullptr;
+            const double* l = leftOf[i] >= 0 ? &val[leftOf[i] * BLOCK] : nullptr;
+            const double* r = rightOf[i] >= 0 ? &val[rightOf[i] * BLOCK] : nullptr;
+            switch (in.op) {
+            case PUSH_CONST:
+                constant--;
+                for (size_t k = 0; k < m; k++)
+                    gradient[constant] += g[k];
+                break;
+            case ABS: for (size_t k = 0; k < m; k++) gl[k] += (l[k] < 0) ? -g[k] : g[k]; break;
+            case ADD: for (size_t k = 0; k < m; k++) { gl[k] += g[k]; gr[k] += g[k]; } break;
+            case SUB: for (size_t k = 0; k < m; k++) { gl[k] += g[k]; gr[k] -= g[k]; } break;
+            case MUL: for (size_t k = 0; k < m; k++) { gl[k] += g[k] * r[k]; gr[k] += g[k] * l[k]; } break;
+            case DIV: for (size_t k = 0; k < m; k++) { gl[k] += g[k] / r[k]; gr[k] -= g[k] * v[k] / r[k]; } break;
+            default: break; // variables have no literal below them and > is flat
+            }
+        }
+    }
+    return sum / data.count();
+}
+
+// Returns the numeric literals in the order they appear in the tree.
+vector<double> CompiledExpression::constants() const {
+    vector<double> values;
+    for (const Instr& in : code)
+        if (in.op == PUSH_CONST)
+            values.push_back(in.value);
+    return values;
+}
+
+void CompiledExpression::setConstants(const vector<double>& values) {
+    size_t next = 0;
+    for (Instr& in : code)
+        if (in.op == PUSH_CONST)
+            in.value = values[next++];
+}
@@ -0,0 +1,217 @@
+#ifndef EVALUATOR_H
+#define EVALUATOR_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "expression_tree.h"
+
+//
+// Datasets held column by column and the compiled batch evaluator that scores trees on them.
+// Part of the ass4 library, which main.cpp and the C API (ass4.h) are built on.
+
+//
+// Input values stored column by column, which is the layout the batch evaluator streams through.
+// After deduplication each row also has a weight, the number of input rows it stands for.
+
+// The values of one column: held in memory, or read in place from a mapped binary input file.
+class Column {
+public:
+    void push_back(double x) { values.push_back(x); }
+    void setView(const double* p, size_t n) { view = p; count = n; } // use n values at p instead
+    const double* data() const { return view != nullptr ? view : values.data(); }
+    size_t size() const { return view != nullptr ? count : values.size(); }
+    const double& operator[](size_t i) const { return data()[i]; }
+    const double* begin() const { return data(); }
+    const double* end() const { return data() + size(); }
+private:
+    std::vector<double> values;
+    const double* view = nullptr;
+    size_t count = 0;
+};
+
+struct Dataset {
+    std::vector<std::string> names;  // column names, in file order
+    std::vector<Column> columns;     // the values of each column, one per row
+    std::vector<double> weights;     // times each row occurred (empty when every row counts once)
+    double weightTotal = 0;          // sum of the weights
+    std::shared_ptr<const void> mapping; // keeps a mapped binary input file alive while columns view it
+    size_t rows() const { return columns.empty() ? 0 : columns[0].size(); }
+    double weight(size_t row) const { return weights.empty() ? 1 : weights[row]; }
+    double count() const { return weights.empty() ? rows() : weightTotal; } // rows before deduplication
+};
+
+// The columns and weights of a dataset converted to the numeric type T, to evaluate in that precision.
+template <typename T>
+struct TypedColumns {
+    std::vector<std::vector<T> > columns;
+    std::vector<T> weights;
+    T count;
+    explicit TypedColumns(const Dataset& data)
+        : weights(data.weights.begin(), data.weights.end()), count(data.count()) {
+        for (auto& column : data.columns)
+            columns.emplace_back(column.begin(), column.end());
+    }
+    size_t rows() const { return columns.empty() ? 0 : columns[0].size(); }
+};
+
+// Adds the outputs for rows start..start+m-1 to sum, each as many times as its row occurred.
+void addOutputs(const Dataset& data, size_t start, size_t m, const double* out, double& sum);
+
+class CompressedColumns; // see below
+
+//
+// A tree flattened into postfix instructions for fast repeated evaluation.
+// Numeric literals are converted once when compiling instead of on every visit, variables read
+// straight from the column they were bound to, and rows are evaluated in blocks so that every
+// instruction runs as a tight loop over the block.
+// The arithmetic is exactly that of evaluateExpression, so the results are identical.
+class CompiledExpression {
+public:
+    explicit CompiledExpression(const LinkedBinaryTree& t); // throws invalid_argument for a bad operand
+    // Compiles for rows where only column inner changes: subtrees that do not read it are hoisted
+    // and computed once per batch, from its first row. Every row of a batch must then agree on
+    // all other columns.
+    CompiledExpression(const LinkedBinaryTree& t, int inner);
+    // Evaluates n rows; columns[c] points to the values of column c for the first of them.
+    // T is the type the arithmetic is done in (double everywhere except with --precision).
+    template <typename T>
+    void evaluateBatch(const T* const* columns, size_t n, T* out) const;
+    void evaluateRange(const Dataset& data, size_t start, size_t n, double* out) const; // evaluates rows start..start+n-1
+    double score(const Dataset& data) const;                // average over all rows, as main computes it
+    template <typename T>
+    T scoreAs(const TypedColumns<T>& data) const;           // the same, with all arithmetic done in T
+    double scoreCompressed(const CompressedColumns& columns, const Dataset& data) const; // the same, on compressed columns
+    // Returns the score and sets gradient to its derivatives with respect to the numeric literals,
+    // in the order they appear in the tree. Not for hoisted programs.
+    double scoreGradient(const Dataset& data, std::vector<double>& gradient) const;
+    std::vector<double> constants() const;                 // the numeric literals, in order
+    void setConstants(const std::vector<double>& values);  // replaces the numeric literals, in order
+
+    static constexpr size_t BLOCK = 256; // rows evaluated together
+private:
+    enum OpCode { PUSH_VAR, PUSH_CONST, PUSH_SLOT, ABS, ADD, SUB, MUL, DIV, GT };
+    struct Instr {
+        OpCode op;
+        int var;      // column for PUSH_VAR, hoisted subtree for PUSH_SLOT
+        double value; // literal for PUSH_CONST
+    };
+    CompiledExpression(const LinkedBinaryTree& t, LinkedBinaryTree::Node* v); // compiles one subtree
+    template <typename T, typename Load>
+    void evaluateBlocks(size_t n, T* out, const T* slots, const Load& load) const; // evaluates with columns supplied by load
+    void compile(const LinkedBinaryTree& t, LinkedBinaryTree::Node* v, int depth); // recursive helper emitting the postfix code
+
+    std::vector<Instr> code; // instructions in postfix order
+    int maxDepth;            // deepest the value stack gets
+    int inner;               // column that changes between rows of a batch, or -1 to hoist nothing
+    std::vector<CompiledExpression> hoisted; // subtrees computed once per batch
+};
+
+// Runs the program over the rows in blocks. The value stack holds one block-sized column per
+// entry, so each instruction is a simple loop the compiler can vectorize.
+template <typename T>
+void CompiledExpression::evaluateBatch(const T* const* columns, size_t n, T* out) const {
+    // Hoisted subtrees are the same on every row, so they are computed from the first.
+    std::vector<T> slots(hoisted.size());
+    for (size_t k = 0; k < hoisted.size(); k++)
+        hoisted[k].evaluateBatch(columns, 1, &slots[k]);
+    evaluateBlocks(n, out, slots.data(), [columns](int var, size_t start, size_t m, T* top) {
+        std::copy(columns[var] + start, columns[var] + start + m, top);
+    });
+}
+
+// Runs the program over n rows, a block at a time; load(var, start, m, top) puts the values of
+// column var for rows start..start+m-1 at top.
+template <typename T, typename Load>
+void CompiledExpression::evaluateBlocks(size_t n, T* out, const T* slots, const Load& load) const {
+    thread_local std::vector<T> stack;
+    if (stack.size() < maxDepth * BLOCK)
+        stack.resize(maxDepth * BLOCK);
+    for (size_t start = 0; start < n; start += BLOCK) {
+        size_t m = std::min(BLOCK, n - start);
+        int sp = -1; // index of the top column
+        for (const Instr& in : code) {
+            if (in.op <= PUSH_SLOT) {
+                T* top = &stack[++sp * BLOCK];
+                if (in.op == PUSH_VAR)
+                    load(in.var, start, m, top);
+                else if (in.op == PUSH_SLOT)
+                    std::fill(top, top + m, slots[in.var]);
+                else
+                    std::fill(top, top + m, T(in.value));
+                continue;
+            }
+            T* top = &stack[sp * BLOCK];
+            if (in.op == ABS) {
+                for (size_t i = 0; i < m; i++)
+                    top[i] = (top[i] < 0) ? -top[i] : top[i];
+                continue;
+            }
+            T* l = top - BLOCK;
+            switch (in.op) {
+            case ADD: for (size_t i = 0; i < m; i++) l[i] = l[i] + top[i]; break;
+            case SUB: for (size_t i = 0; i < m; i++) l[i] = l[i] - top[i]; break;
+            case MUL: for (size_t i = 0; i < m; i++) l[i] = l[i] * top[i]; break;
+            case DIV: for (size_t i = 0; i < m; i++) l[i] = l[i] / top[i]; break;
+            case GT:  for (size_t i = 0; i < m; i++) l[i] = (l[i] > top[i]) ? 1 : -1; break;
+            default: break;
+            }
+            sp--;
+        }
+        std::copy(&stack[0], &stack[0] + m, out + start);
+    }
+}
+
+// Like score, but on columns of type T, with the outputs summed in T as well.
+template <typename T>
+T CompiledExpression::scoreAs(const TypedColumns<T>& data) const {
+    T out[BLOCK];
+    T sum = 0;
+    std::vector<const T*> columns(data.columns.size());
+    for (size_t start = 0; start < data.rows(); start += BLOCK) {
+        size_t m = std::min(BLOCK, data.rows() - start);
+        for (size_t c = 0; c < columns.size(); c++)
+            columns[c] = data.columns[c].data() + start;
+        evaluateBatch(columns.data(), m, out);
+        for (size_t i = 0; i < m; i++)
+            sum += data.weights.empty() ? out[i] : data.weights[start + i] * out[i];
+    }
+    return sum / data.count;
+}
+
+//
+// With --compress E, each column is stored a block of rows at a time as 16-bit codes: a value is
+// lo + code * step, with lo and step chosen per block, which is a quarter of the bytes of a double.
+// A block is only quantized if every value comes back within E of the original; blocks with NaN
+// or infinities, or too wide a range for E, are kept as doubles. When the values of a block are
+// integers spanning less than 65536, a step of 1 is tried first, which decodes them exactly.
+// Scoring decodes each block straight into the evaluator's value stack as the variable is pushed,
+// so the doubles are never stored and every tree streams a quarter of the memory.
+class CompressedColumns {
+public:
+    CompressedColumns(const Dataset& data, double maxError);
+    // Writes the m values of column c starting at row start (a multiple of BLOCK) to out.
+    void decode(size_t c, size_t start, size_t m, double* out) const;
+    double ratio() const;       // compressed size over uncompressed size
+    size_t quantizedBlocks() const { return quantized; }
+    size_t totalBlocks() const { return total; }
+
+    static constexpr size_t BLOCK = CompiledExpression::BLOCK;
+private:
+    struct Block {
+        double lo;
+        double step;  // 0 for a block kept as doubles
+        size_t index; // offset into codes, or into raw when step is 0
+    };
+    static void decodeCodes(const uint16_t* codes, double lo, double step, size_t m, double* out);
+    std::vector<std::vector<Block> > blocks; // per column
+    std::vector<std::vector<uint16_t> > codes;
+    std::vector<std::vector<double> > raw;
+    size_t quantized = 0, total = 0;
+};
+
+#endif
@@ -0,0 +1,853 @@
+#include "expression_tree.h"
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <list>
+#include <stack>
+#include <algorithm>
+#include <cstring>
+#include <charconv>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+using namespace std;
+
+//*****************************************************
+// Constructor & Basic Methods
+
+LinkedBinaryTree::LinkedBinaryTree() : _root(nullptr), n(0), score(0.0), scoreError(0.0) {}
+
+// Returns the total number of nodes in the tree
+int LinkedBinaryTree::size() const { return n; }
+
+// Checks if tree is empty
+bool LinkedBinaryTree::empty() const { return size() == 0; }
+
+// Returns a Position representing the root
+LinkedBinaryTree::Position LinkedBinaryTree::root() const { return Position(_root); }
+
+// Adds a new root node to an empty tree
+void LinkedBinaryTree::addRoot() {
+    _root = new Node;
+    n = 1;
+}
+
+// Expands an external node (leaf) by adding two children nodes
+void LinkedBinaryTree::expandExternal(const Position &p) {
+    Node* v = p.v;
+    v->left = new Node;
+    v->left->par = v;
+    v->right = new Node;
+    v->right->par = v;
+    n += 2;
+}
+
+// Expands an external node by adding just a left child, the operand of a unary operator like abs
+void LinkedBinaryTree::expandExternalUnary(const Position &p) {
+    Node* v = p.v;
+    v->left = new Node;
+    v->left->par = v;
+    n += 1;
+}
+
+// Removes an external node and its parent, replacing them with the sibling node
+LinkedBinaryTree::Position LinkedBinaryTree::removeAboveExternal(const Position &p) {
+    Node* w = p.v;
+    Node* v = w->par;
+    Node* sib = (w == v->left ? v->right : v->left);
+    if (v == _root) {
+        _root = sib;
+        sib->par = nullptr;
+    } else {
+        Node* gpar = v->par;
+        if (v == gpar->left)
+            gpar->left = sib;
+        else
+            gpar->right = sib;
+        sib->par = gpar;
+    }
+    delete w;
+    delete v;
+    n -= 2;
+    return Position(sib);
+}
+
+// Deletes the subtrees below a node, leaving it external
+void LinkedBinaryTree::pruneBelow(const Position &p) {
+    Node* v = p.v;
+    n -= countNodes(v) - 1;
+    destroy(v->left);
+    destroy(v->right);
+    v->left = v->right = nullptr;
+    v->var = -1;
+}
+
+// Returns a list of all positions in the tree using preorder traversal
+LinkedBinaryTree::PositionList LinkedBinaryTree::positions() const {
+    PositionList pl;
+    preorder(_root, pl);
+    return PositionList(pl);
+}
+
+// Helper: Preorder traversal to collect positions
+void LinkedBinaryTree::preorder(Node* v, PositionList &pl) const {
+    if (v == nullptr) return;
+    pl.push_back(Position(v));
+    if (v->left != nullptr)
+        preorder(v->left, pl);
+    if (v->right != nullptr)
+        preorder(v->right, pl);
+}
+
+//*****************************************************
+// New Methods for Expression Trees
+
+// Recursively renders the expresion tree in infix notation with proper parenthesis, appending to out.
+// If the node is a leaf, its value is printed directly. For non-leaf nodes,
+// if the node represents the unary operator "abs", it prints it accordingly.
+void LinkedBinaryTree::renderExpression(string& out, Node* v) const {
+    if (v == nullptr)
+        return;
+    // If it's a leaf node, simply print its element.
+    if (v->left == nullptr && v->right == nullptr) {
+        out += v->elt;
+    } else {
+        // For the unary operator "abs"
+        if (v->elt == "abs") {
+            out += "abs(";
+            renderExpression(out, v->left);
+            out += ')';
+        } else {
+            // For binary operators, print with parentheses: (left operator right)
+            out += '(';
+            renderExpression(out, v->left);
+            out += v->elt; // print the operator
+            renderExpression(out, v->right);
+            out += ')';
+        }
+    }
+}
+
+void LinkedBinaryTree::renderExpression(string& out) const {
+    renderExpression(out, _root);
+}
+
+void LinkedBinaryTree::printExpression() const {
+    printExpression(cout);
+}
+
+// Renders into a buffer first so the stream is written once instead of token by token.
+void LinkedBinaryTree::printExpression(ostream& out) const {
+    string buf;
+    renderExpression(buf, _root);
+    out << buf;
+}
+
+// Applies a binary operator to the values of its two subtrees.
+// NOTE: For the operator ">", returns 1 if left > right else -1.
+static double applyOperator(const string& op, double leftVal, double rightVal) {
+    if (op == "+")
+        return leftVal + rightVal;
+    else if (op == "-")
+        return leftVal - rightVal;
+    else if (op == "*")
+        return leftVal * rightVal;
+    else if (op == "/")
+        return leftVal / rightVal;
+    else if (op == ">")
+        return (leftVal > rightVal) ? 1 : -1;
+    else
+        return 0; // Should not occur (unexpected operator)
+}
+
+// Recursively evaluates the expresion tree using the values in row.
+// If the node is a leaf, returns the value of the variable (its column in row) or numeric literal.
+// For operator nodes, recursively evalutes subtrees and applies the operator.
+double LinkedBinaryTree::evaluateExpression(Node* v, const double* row) const {
+    if (v == nullptr) return 0;
+    // If it's a leaf, check if it's a variable or a number.
+    if (v->left == nullptr && v->right == nullptr) {
+        if (v->var >= 0)
+            return row[v->var];
+        else
+            return std::stod(v->elt);  // convert string to double
+    }
+    // For the unary operator "abs"
+    if (v->elt == "abs") {
+        double val = evaluateExpression(v->left, row);
+        return (val < 0) ? -val : val;
+    }
+    // For binary operators, evaluate both left and right subtrees.
+    double leftVal = evaluateExpression(v->left, row);
+    double rightVal = evaluateExpression(v->right, row);
+    return applyOperator(v->elt, leftVal, rightVal);
+}
+
+// Recursively evaluates the expresion tree given values for a and b. Leaves are matched by name,
+// so this works on trees built by hand as well as on parsed ones.
+double LinkedBinaryTree::evaluateExpression(Node* v, double a, double b) const {
+    if (v == nullptr) return 0;
+    if (v->left == nullptr && v->right == nullptr) {
+        if (v->elt == "a")
+            return a;
+        else if (v->elt == "b")
+            return b;
+        else
+            return std::stod(v->elt);  // convert string to double
+    }
+    if (v->elt == "abs") {
+        double val = evaluateExpression(v->left, a, b);
+        return (val < 0) ? -val : val;
+    }
+    double leftVal = evaluateExpression(v->left, a, b);
+    double rightVal = evaluateExpression(v->right, a, b);
+    return applyOperator(v->elt, leftVal, rightVal);
+}
+
+double LinkedBinaryTree::evaluateExpression(double a, double b) const {
+    return evaluateExpression(_root, a, b);
+}
+
+double LinkedBinaryTree::evaluateExpression(const double* row) const {
+    return evaluateExpression(_root, row);
+}
+
+// Recursively checks whether any variable leaf under v reads the given column.
+bool LinkedBinaryTree::dependsOn(Node* v, int column) const {
+    if (v == nullptr) return false;
+    if (v->left == nullptr && v->right == nullptr)
+        return v->var == column;
+    return dependsOn(v->left, column) || dependsOn(v->right, column);
+}
+
+bool LinkedBinaryTree::dependsOn(const Position& p, int column) const {
+    return dependsOn(p.v, column);
+}
+
+// Recursively resolves every variable leaf under v to the index of its column.
+// A leaf that names a column is a variable; any other leaf must be a number.
+bool LinkedBinaryTree::bindVariables(Node* v, const vector<string>& columns, string& error) {
+    if (v == nullptr) return true;
+    if (v->left == nullptr && v->right == nullptr) {
+        auto it = find(columns.begin(), columns.end(), v->elt);
+        if (it != columns.end()) {
+            v->var = it - columns.begin();
+            return true;
+        }
+        v->var = -1;
+        try {
+            std::stod(v->elt);
+        } catch (const logic_error&) {
+            error = "Unknown variable " + v->elt;
+            return false;
+        }
+        return true;
+    }
+    return bindVariables(v->left, columns, error) && bindVariables(v->right, columns, error);
+}
+
+bool LinkedBinaryTree::bindVariables(const vector<string>& columns, string& error) {
+    return bindVariables(_root, columns, error);
+}
+
+// Returns the average score stored in the tree
+double LinkedBinaryTree::getScore() const {
+    return score;
+}
+
+// Sets the tree's score value
+void LinkedBinaryTree::setScore(double s) {
+    score = s;
+    scoreError = 0;
+}
+
+// Sets a score estimated from a sample of the rows, along with the half width of its confidence interval
+void LinkedBinaryTree::setScore(double s, double error) {
+    score = s;
+    scoreError = error;
+}
+
+// Returns the half width of the score's confidence interval
+double LinkedBinaryTree::getScoreError() const {
+    return scoreError;
+}
+
+// Overload the less-than operator to compare trees by score.
+// This is useful for sorting trees.
+bool LinkedBinaryTree::operator<(const LinkedBinaryTree &other) const {
+    return this->score < other.score;
+}
+
+//*****************************************************
+// Canonical Hashing
+
+// Recursively hashes the subtree rooted at v in a canonical form:
+//  - numeric literals are hashed by their value, so "1" and "1.0" hash the same,
+//  - the operands of "+" and "*" are hashed in sorted order, since swapping them
+//    never changes the result in IEEE arithmetic.
+// Two trees with the same canonical hash therefore always get the same score.
+uint64_t LinkedBinaryTree::canonicalHash(Node* v) const {
+    if (v == nullptr) return 0;
+    if (v->left == nullptr && v->right == nullptr) {
+        if (v->var >= 0)
+            return hashCombine(1, hashString(v->elt));
+        double value = std::stod(v->elt);
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        return hashCombine(2, bits);
+    }
+    uint64_t h = hashCombine(3, hashString(v->elt));
+    uint64_t l = canonicalHash(v->left);
+    uint64_t r = canonicalHash(v->right);
+    if ((v->elt == "+" || v->elt == "*") && r < l)
+        swap(l, r);
+    return hashCombine(hashCombine(h, l), r);
+}
+
+uint64_t LinkedBinaryTree::canonicalHash() const {
+    return canonicalHash(_root);
+}
+
+//*****************************************************
+// Interval Bounds
+
+// Returns the bounds of l + r, l - r, l * r, ... given the bounds of the operands. Rounding is
+// monotone, so bounds computed with ordinary floating point arithmetic also hold for the rounded
+// results evaluateExpression produces.
+Interval unboundedInterval(bool mayBeNaN) {
+    return {-numeric_limits<double>::infinity(), numeric_limits<double>::infinity(), mayBeNaN};
+}
+
+static bool hasInfinity(const Interval& x) {
+    return isinf(x.lo) || isinf(x.hi);
+}
+
+static bool containsZero(const Interval& x) {
+    return x.lo <= 0 && x.hi >= 0;
+}
+
+// Bounds the result of operator op applied to operands bounded by l and r (r is unused for abs).
+static Interval applyBounds(const string& op, const Interval& l, const Interval& r) {
+    if (op == "abs") {
+        if (l.lo >= 0)
+            return l;
+        if (l.hi <= 0)
+            return {-l.hi, -l.lo, l.mayBeNaN};
+        return {0, max(-l.lo, l.hi), l.mayBeNaN};
+    }
+    bool nan = l.mayBeNaN || r.mayBeNaN;
+    if (op == ">") {
+        // A NaN operand makes the comparison false, so only a sure "true" needs both sides to be numbers.
+        if (!nan && l.lo > r.hi)
+            return {1, 1, false};
+        if (!(l.hi > r.lo))
+            return {-1, -1, false};
+        return {-1, 1, false};
+    }
+    if (op == "+") {
+        if ((l.hi == INFINITY && r.lo == -INFINITY) || (l.lo == -INFINITY && r.hi == INFINITY))
+            return unboundedInterval(true); // inf + -inf
+        return {l.lo + r.lo, l.hi + r.hi, nan};
+    }
+    if (op == "-") {
+        if ((l.hi == INFINITY && r.hi == INFINITY) || (l.lo == -INFINITY && r.lo == -INFINITY))
+            return unboundedInterval(true); // inf - inf
+        return {l.lo - r.hi, l.hi - r.lo, nan};
+    }
+    if (op == "*") {
+        if ((containsZero(l) && hasInfinity(r)) || (containsZero(r) && hasInfinity(l)))
+            return unboundedInterval(true); // 0 * inf
+        double p[4] = {l.lo * r.lo, l.lo * r.hi, l.hi * r.lo, l.hi * r.hi};
+        return {*min_element(p, p + 4), *max_element(p, p + 4), nan};
+    }
+    if (op == "/") {
+        if (containsZero(r))
+            return unboundedInterval(nan || containsZero(l) || hasInfinity(l)); // x / 0, 0 / 0
+        if (hasInfinity(l) && hasInfinity(r))
+            return unboundedInterval(true); // inf / inf
+        double q[4] = {l.lo / r.lo, l.lo / r.hi, l.hi / r.lo, l.hi / r.hi};
+        return {*min_element(q, q + 4), *max_element(q, q + 4), nan};
+    }
+    return {0, 0, false}; // Should not occur (unexpected operator)
+}
+
+// Recursively bounds the value of the subtree rooted at v when every column lies in its domain.
+Interval LinkedBinaryTree::bounds(Node* v, const vector<Interval>& domain) const {
+    if (v == nullptr) return {0, 0, false};
+    if (v->left == nullptr && v->right == nullptr) {
+        if (v->var >= 0)
+            return domain[v->var];
+        double value = std::stod(v->elt);
+        if (isnan(value))
+            return unboundedInterval(true);
+        return {value, value, false};
+    }
+    Interval l = bounds(v->left, domain);
+    Interval r = v->right != nullptr ? bounds(v->right, domain) : l;
+    return applyBounds(v->elt, l, r);
+}
+
+Interval LinkedBinaryTree::bounds(const vector<Interval>& domain) const {
+    return bounds(_root, domain);
+}
+
+//*****************************************************
+// Algebraic Simplification
+
+//
+// Rewrites a tree into a smaller one that evaluates to exactly the same doubles on every row whose
+// values lie in the domain (NaN results and the sign of NaN included). The rules:
+//  - a subtree whose bounds are a single number is replaced by that number (this folds constants,
+//    and also x > y when the bounds decide it), unless the number is a zero whose sign matters
+//  - x*1, 1*x, x/1, x-0 and x+(-0) become x; x+0 and 0+x become x where the sign of zero does not matter
+//  - abs(x) becomes x when x >= 0 (abs keeps -0, so this holds for zeros too); abs(x > y) becomes 1
+//  - x > x becomes -1 (also right for NaN, which compares false)
+//  - x - x becomes 0 and x / x becomes 1 when x is finite (and nonzero for the division)
+// The sign of a zero matters unless every path to the root passes through a comparison or the left
+// operand of a division, or reaches a root whose caller ignores it (a sum starting at +0 does).
+
+// Checks whether the subtrees rooted at x and y are identical.
+bool LinkedBinaryTree::sameSubtree(Node* x, Node* y) {
+    if (x == nullptr || y == nullptr)
+        return x == y;
+    return x->elt == y->elt && x->var == y->var && sameSubtree(x->left, y->left) && sameSubtree(x->right, y->right);
+}
+
+// Checks whether v is a numeric literal equal to value, with the same sign if value is zero.
+static bool isLiteral(const string& elt, int var, double value) {
+    if (var >= 0) return false;
+    double x = std::stod(elt);
+    return x == value && signbit(x) == signbit(value);
+}
+
+// Turns v into a literal leaf holding value, written with the fewest digits that read back exactly.
+LinkedBinaryTree::Node* LinkedBinaryTree::makeLiteral(Node* v, double value) {
+    destroy(v->left);
+    destroy(v->right);
+    v->left = v->right = nullptr;
+    v->var = -1;
+    char buf[32];
+    auto res = to_chars(buf, buf + sizeof(buf), value);
+    v->elt.assign(buf, res.ptr);
+    return v;
+}
+
+// Deletes v and everything under it except child, which takes its place.
+LinkedBinaryTree::Node* LinkedBinaryTree::keepChild(Node* v, Node* child) {
+    if (v->left == child)
+        v->left = nullptr;
+    else
+        v->right = nullptr;
+    destroy(v);
+    return child;
+}
+
+// Recursively simplifies the subtree rooted at v, returning the node that replaces it and setting
+// range to its bounds. zeroSign tells whether the sign of a zero result matters to the parent.
+LinkedBinaryTree::Node* LinkedBinaryTree::simplify(Node* v, const vector<Interval>& domain, bool zeroSign,
+                                                   Interval& range) {
+    if (v == nullptr) {
+        range = {0, 0, false};
+        return v;
+    }
+    if (v->left == nullptr && v->right == nullptr) {
+        range = bounds(v, domain);
+        return v;
+    }
+    const string& op = v->elt;
+    Interval l, r;
+    v->left = simplify(v->left, domain, op == ">" ? false : zeroSign, l);
+    v->left->par = v;
+    if (v->right != nullptr) {
+        v->right = simplify(v->right, domain, op == ">" ? false : (op == "/" ? true : zeroSign), r);
+        v->right->par = v;
+    } else {
+        r = l;
+    }
+    range = applyBounds(op, l, r);
+    Node* x = v->left;
+    Node* y = v->right;
+
+    // Subnormal numbers are left alone since stod rejects them as out of range.
+    if (range.lo == range.hi && !range.mayBeNaN && (range.lo != 0 || !zeroSign)
+        && fpclassify(range.lo) != FP_SUBNORMAL)
+        return makeLiteral(v, range.lo);
+    if (op == "abs") {
+        if (l.lo >= 0) {
+            range = l;
+            return keepChild(v, x);
+        }
+        if (x->elt == ">" && x->left != nullptr)
+            return makeLiteral(v, 1);
+        return v;
+    }
+    bool finite = !l.mayBeNaN && !hasInfinity(l);
+    if (op == ">" && sameSubtree(x, y))
+        return makeLiteral(v, -1);
+    if (op == "-" && finite && sameSubtree(x, y))
+        return makeLiteral(v, 0);
+    if (op == "/" && finite && !containsZero(l) && sameSubtree(x, y))
+        return makeLiteral(v, 1);
+    // Identities: keep the other operand, whose bounds are then the result's.
+    bool leftLeaf = x->left == nullptr && x->right == nullptr;
+    bool rightLeaf = y->left == nullptr && y->right == nullptr;
+    if (rightLeaf && ((op == "*" && isLiteral(y->elt, y->var, 1)) || (op == "/" && isLiteral(y->elt, y->var, 1))
+                      || (op == "-" && isLiteral(y->elt, y->var, 0)) || (op == "+" && isLiteral(y->elt, y->var, -0.0))
+                      || (op == "+" && !zeroSign && isLiteral(y->elt, y->var, 0)))) {
+        range = l;
+        return keepChild(v, x);
+    }
+    if (leftLeaf && ((op == "*" && isLiteral(x->elt, x->var, 1)) || (op == "+" && isLiteral(x->elt, x->var, -0.0))
+                     || (op == "+" && !zeroSign && isLiteral(x->elt, x->var, 0)))) {
+        range = r;
+        return keepChild(v, y);
+    }
+    return v;
+}
+
+// Simplifies the tree for rows whose columns lie in domain. With keepZeroSign false the tree's
+// value may change from -0 to 0 or back, which is fine when only the sum of the values is used.
+void LinkedBinaryTree::simplify(const vector<Interval>& domain, bool keepZeroSign) {
+    Interval range;
+    _root = simplify(_root, domain, keepZeroSign, range);
+    if (_root != nullptr)
+        _root->par = nullptr;
+    n = countNodes(_root);
+}
+
+//*****************************************************
+// Reassociation
+
+//
+// A chain like ((((a+b)+c)+d)+e) is evaluated one addition after another, each waiting for the
+// last. Rebalancing regroups the operands of every chain of + (or of *) into a balanced tree,
+// ((a+b)+(c+d))+e, keeping their left to right order, so independent operations can overlap.
+// Floating point addition and multiplication are not associative, so the rebalanced tree can
+// round differently; this is why it is only done on request.
+
+// Recursively computes the number of nodes on the longest path down from v.
+int LinkedBinaryTree::height(Node* v) const {
+    if (v == nullptr)
+        return 0;
+    return 1 + max(height(v->left), height(v->right));
+}
+
+int LinkedBinaryTree::height() const {
+    return height(_root);
+}
+
+// Collects the operands of the chain of op nodes rooted at v in left to right order, along with
+// the chain's nodes, which are reused when it is rebuilt.
+void LinkedBinaryTree::collectChain(Node* v, const string& op, vector<Node*>& operands, vector<Node*>& links) {
+    if (v->elt != op || v->left == nullptr) {
+        operands.push_back(v);
+        return;
+    }
+    links.push_back(v);
+    collectChain(v->left, op, operands, links);
+    collectChain(v->right, op, operands, links);
+}
+
+// Builds a tree over the operands, in order, out of the chain nodes in links. The adjacent pair whose
+// taller member is shortest is joined first (the leftmost such pair on ties), which gives the
+// lowest possible tree for operands of different heights (Golumbic's minimax rule).
+LinkedBinaryTree::Node* LinkedBinaryTree::buildBalanced(vector<Node*>& operands, vector<Node*>& links) const {
+    vector<int> heights;
+    for (Node* x : operands)
+        heights.push_back(height(x));
+    while (operands.size() > 1) {
+        size_t best = 0;
+        for (size_t i = 1; i + 1 < operands.size(); i++)
+            if (max(heights[i], heights[i + 1]) < max(heights[best], heights[best + 1]))
+                best = i;
+        Node* v = links.back();
+        links.pop_back();
+        v->left = operands[best];
+        v->right = operands[best + 1];
+        v->left->par = v;
+        v->right->par = v;
+        operands[best] = v;
+        heights[best] = max(heights[best], heights[best + 1]) + 1;
+        operands.erase(operands.begin() + best + 1);
+        heights.erase(heights.begin() + best + 1);
+    }
+    return operands[0];
+}
+
+// Recursively rebalances the chains in the subtree rooted at v, returning its new root.
+LinkedBinaryTree::Node* LinkedBinaryTree::rebalance(Node* v) {
+    if (v == nullptr || (v->left == nullptr && v->right == nullptr))
+        return v;
+    if (v->elt != "+" && v->elt != "*") {
+        v->left = rebalance(v->left);
+        v->left->par = v;
+        if (v->right != nullptr) {
+            v->right = rebalance(v->right);
+            v->right->par = v;
+        }
+        return v;
+    }
+    vector<Node*> operands, links;
+    collectChain(v, v->elt, operands, links);
+    for (auto& x : operands)
+        x = rebalance(x);
+    return buildBalanced(operands, links);
+}
+
+void LinkedBinaryTree::rebalance() {
+    _root = rebalance(_root);
+    if (_root != nullptr)
+        _root->par = nullptr;
+}
+
+//*****************************************************
+// Rewriting Constants
+
+// Recursively rewrites the literal leaves under v from values, in order.
+void LinkedBinaryTree::setConstants(Node* v, const vector<double>& values, size_t& next) {
+    if (v == nullptr) return;
+    if (v->left == nullptr && v->right == nullptr) {
+        if (v->var < 0) {
+            char buf[32];
+            auto res = to_chars(buf, buf + sizeof(buf), values[next++]);
+            v->elt.assign(buf, res.ptr);
+        }
+        return;
+    }
+    setConstants(v->left, values, next);
+    setConstants(v->right, values, next);
+}
+
+void LinkedBinaryTree::setConstants(const vector<double>& values) {
+    size_t next = 0;
+    setConstants(_root, values, next);
+}
+
+//*****************************************************
+// Helper Functions for Deep Copy and Destruction
+
+// Recursively clones the subtree rooted at v and returns a pointer to the new clone.
+// CHATGPT was used here to design this recursive clone method for deep copying.
+LinkedBinaryTree::Node* LinkedBinaryTree::clone(LinkedBinaryTree::Node* v) const {
+    if (v == nullptr)
+        return nullptr;
+    LinkedBinaryTree::Node* newNode = new LinkedBinaryTree::Node;
+    newNode->elt = v->elt;
+    newNode->var = v->var;
+    newNode->left = clone(v->left);
+    if(newNode->left != nullptr)
+        newNode->left->par = newNode;
+    newNode->right = clone(v->right);
+    if(newNode->right != nullptr)
+        newNode->right->par = newNode;
+    return newNode;
+}
+
+// Recursively destroys (deletes) the subtree rooted at v to free memory.
+void LinkedBinaryTree::destroy(Node* v) {
+    if (v != nullptr) {
+        destroy(v->left);
+        destroy(v->right);
+        delete v;
+    }
+}
+
+// Recursively counts the nodes in the subtree rooted at v.
+int LinkedBinaryTree::countNodes(Node* v) const {
+    if (v == nullptr)
+        return 0;
+    return 1 + countNodes(v->left) + countNodes(v->right);
+}
+
+//*****************************************************
+// Big Three: Copy Constructor, Assignment Operator, Destructor
+
+// Copy constructor that makes a deep copy of the other tree.
+// CHATGPT was used here for guidance on recursive deep copying.
+LinkedBinaryTree::LinkedBinaryTree(const LinkedBinaryTree &other) : score(other.score), scoreError(other.scoreError) {
+    _root = clone(other._root);
+    n = countNodes(_root);
+}
+
+// Assignment operator that frees existing memory and deep copies the other tree.
+LinkedBinaryTree& LinkedBinaryTree::operator=(const LinkedBinaryTree &other) {
+    if (this != &other) {
+        destroy(_root);
+        _root = clone(other._root);
+        n = countNodes(_root);
+        score = other.score;
+        scoreError = other.scoreError;
+    }
+    return *this;
+}
+
+// Destructor that cleans up all allocated nodes.
+LinkedBinaryTree::~LinkedBinaryTree() {
+    destroy(_root);
+}
+
+//*****************************************************
+// Persistent Trees
+
+PersistentTree::Ref PersistentTree::leaf(const Elem& elt, int var) {
+    return make_shared<const Node>(Node{elt, var, nullptr, nullptr, 1});
+}
+
+PersistentTree::Ref PersistentTree::join(const Elem& op, const Ref& left, const Ref& right) {
+    int count = 1 + (left ? left->count : 0) + (right ? right->count : 0);
+    return make_shared<const Node>(Node{op, -1, left, right, count});
+}
+
+PersistentTree::Ref PersistentTree::copyFrom(const LinkedBinaryTree::Node* v) {
+    if (v == nullptr)
+        return nullptr;
+    if (v->left == nullptr && v->right == nullptr)
+        return leaf(v->elt, v->var);
+    return join(v->elt, copyFrom(v->left), copyFrom(v->right));
+}
+
+PersistentTree::PersistentTree(const LinkedBinaryTree& t) : _root(copyFrom(t._root)), score(t.score) {}
+
+LinkedBinaryTree::Node* PersistentTree::copyTo(const Ref& v, LinkedBinaryTree::Node* par) {
+    if (!v)
+        return nullptr;
+    LinkedBinaryTree::Node* w = new LinkedBinaryTree::Node;
+    w->elt = v->elt;
+    w->var = v->var;
+    w->par = par;
+    w->left = copyTo(v->left, w);
+    w->right = copyTo(v->right, w);
+    return w;
+}
+
+LinkedBinaryTree PersistentTree::toTree() const {
+    LinkedBinaryTree t;
+    t._root = copyTo(_root, nullptr);
+    t.n = size();
+    t.setScore(score);
+    return t;
+}
+
+static void checkIndex(int index, int size) {
+    if (index < 0 || index >= size)
+        throw out_of_range("node index " + to_string(index) + " of a tree of " + to_string(size) + " nodes");
+}
+
+// Walks down from the root, skipping whole subtrees by their node counts.
+PersistentTree::Ref PersistentTree::subtree(int index) const {
+    checkIndex(index, size());
+    Ref v = _root;
+    while (v && index > 0) {
+        index--; // step past v itself
+        int leftCount = v->left ? v->left->count : 0;
+        if (index < leftCount) {
+            v = v->left;
+        } else {
+            index -= leftCount;
+            v = v->right;
+        }
+    }
+    return v;
+}
+
+// Rebuilds the nodes on the path to the index-th node; the subtrees off the path are shared.
+PersistentTree::Ref PersistentTree::replace(const Ref& v, int index, const Ref& sub) {
+    if (index == 0)
+        return sub;
+    int leftCount = v->left ? v->left->count : 0;
+    if (index - 1 < leftCount)
+        return join(v->elt, replace(v->left, index - 1, sub), v->right);
+    return join(v->elt, v->left, replace(v->right, index - 1 - leftCount, sub));
+}
+
+PersistentTree PersistentTree::replace(int index, const Ref& sub) const {
+    checkIndex(index, size());
+    PersistentTree result(replace(_root, index, sub));
+    result.score = score;
+    return result;
+}
+
+//*****************************************************
+// Parsing Postfix Expressions
+
+//
+// This function builds a binary expression tree from a postfix expression string.
+// It uses a stack to manage operands and operators. For each token:
+//  - If it's an operand, create a single node tree.
+//  - If it's an operator, pop one or two trees (depending on whether it is unary or binary)
+//    and make them subtrees of a new node containing the operator.
+// CHATGPT was used here to quickly devise the stack based algorithm.
+// Variables are resolved once here to the index of their column in the input.
+// On an invalid expression it returns false and describes the problem in error.
+bool parseExpressionTree(const string& postfix, const vector<string>& columns,
+                         LinkedBinaryTree& result, string& error) {
+    stack<LinkedBinaryTree> s;
+    istringstream iss(postfix);
+    string token;
+    while (iss >> token) {
+        // Check if the token is an operator.
+        if (token == "abs" || token == "+" || token == "-" || token == "*" || token == "/" || token == ">") {
+            if (token == "abs") { // Unary operator
+                if (s.empty()) {
+                    error = "Invalid postfix expression: not enough operands for abs";
+                    return false;
+                }
+                LinkedBinaryTree operandTree = s.top();
+                s.pop();
+                LinkedBinaryTree T;
+                T.addRoot();
+                T.root().setElement(token);
+                // Attach the operand tree as the left child.
+                T._root->left = operandTree._root;
+                if (T._root->left != nullptr)
+                    T._root->left->par = T._root;
+                // For "abs", the right child is not used.
+                T._root->right = nullptr;
+                T.n = operandTree.n + 1;
+                // Invalidate the operand tree so its destructor won't delete nodes.
+                operandTree._root = nullptr;
+                operandTree.n = 0;
+                s.push(T);
+            } else { // Binary operator
+                if (s.size() < 2) {
+                    error = "Invalid postfix expression: not enough operands for " + token;
+                    return false;
+                }
+                LinkedBinaryTree rightTree = s.top();
+                s.pop();
+                LinkedBinaryTree leftTree = s.top();
+                s.pop();
+                LinkedBinaryTree T;
+                T.addRoot();
+                T.root().setElement(token);
+                // Attach left and right subtrees.
+                T._root->left = leftTree._root;
+                if (T._root->left != nullptr)
+                    T._root->left->par = T._root;
+                T._root->right = rightTree._root;
+                if (T._root->right != nullptr)
+                    T._root->right->par = T._root;
+                T.n = leftTree.n + rightTree.n + 1;
+                // Invalidate the old trees so they don't delete nodes in their destructor.
+                leftTree._root = nullptr; leftTree.n = 0;
+                rightTree._root = nullptr; rightTree.n = 0;
+                s.push(T);
+            }
+        } else {
+            // Token is an operand: either a variable (a column name) or a numeric literal.
+            LinkedBinaryTree T;
+            T.addRoot();
+            T.root().setElement(token);
+            T.n = 1;
+            s.push(T);
+        }
+    }
+    if (s.size() != 1) {
+        error = "Invalid postfix expression: remaining trees in stack";
+        return false;
+    }
+    result = s.top();
+    return result.bindVariables(columns, error);
+}
@@ -0,0 +1,208 @@
+#ifndef EXPRESSION_TREE_H
+#define EXPRESSION_TREE_H
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+//
+// Expression trees: the linked binary tree, its analyses and rewrites, and the postfix parser.
+// Part of the ass4 library, which main.cpp and the C API (ass4.h) are built on.
+
+// We use a string to represent the element since it can be a number, an operatr, or a variable
+typedef std::string Elem;
+
+// A range [lo, hi] of values an expression can take, used to bound a tree's score without evaluating it.
+struct Interval {
+    double lo;
+    double hi;
+    bool mayBeNaN; // NaN is possible as well as the values in [lo, hi]
+};
+
+// The interval of every value, with or without NaN.
+Interval unboundedInterval(bool mayBeNaN);
+
+// Mixes the bits of x (the splitmix64 finalizer) so that nearby inputs give unrelated hashes.
+inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// Combines a hash value into a running seed (order dependent).
+inline uint64_t hashCombine(uint64_t seed, uint64_t v) {
+    return mix64(seed ^ (v + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2)));
+}
+
+// Hashes a string with FNV-1a.
+inline uint64_t hashString(const std::string& s) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned char c : s) {
+        h ^= c;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+class LinkedBinaryTree {
+protected:
+    // Node struct holds each node's data and pointers to its parent and children
+    struct Node {
+        Elem elt;       // element: number, operator, or variable
+        Node* par;      // pointer to the parent node
+        Node* left;     // pointer to left child
+        Node* right;    // pointer to right child
+        int var;        // input column read by a variable leaf, or -1 (set by bindVariables)
+        Node() : elt(""), par(nullptr), left(nullptr), right(nullptr), var(-1) {} // default constructor
+    };
+public:
+    // The Position class gives a user-friendly handle to a Node pointer.
+    class Position {
+    private:
+        Node* v; // pointer to the node in the tree
+    public:
+        Position(Node* _v = nullptr) : v(_v) {}
+        const Elem& operator*() const { return v->elt; } // overloaded * operator to read the element
+        // Replaces the element. The new one may not be the variable the leaf was bound to, so its
+        // column binding is dropped until bindVariables runs again.
+        void setElement(const Elem& e) { v->elt = e; v->var = -1; }
+        Position left() const { return Position(v->left); }  // get left child position
+        Position right() const { return Position(v->right); } // get right child position
+        Position parent() const { return Position(v->par); }  // get parent position
+        bool isRoot() const { return v->par == nullptr; }     // check if this is root
+        bool isExternal() const { return v->left == nullptr && v->right == nullptr; } // check if a leaf
+        friend class LinkedBinaryTree;
+    };
+    typedef std::list<Position> PositionList;
+public:
+    LinkedBinaryTree();
+    // Big Three: copy constructor, assignment operator, and destructor.
+    LinkedBinaryTree(const LinkedBinaryTree &other);
+    LinkedBinaryTree& operator=(const LinkedBinaryTree &other);
+    ~LinkedBinaryTree();
+
+    int size() const;
+    bool empty() const;
+    Position root() const;
+    PositionList positions() const;
+    void addRoot();
+    void expandExternal(const Position &p);
+    void expandExternalUnary(const Position &p); // adds only a left child, for a unary operator
+    Position removeAboveExternal(const Position &p);
+    void pruneBelow(const Position &p);          // removes everything below p, making it external
+
+    // New methods for expression tree functionality
+    void printExpression() const;        // prints the expresion tree in infix form with parentheses
+    void printExpression(std::ostream& out) const; // same, but writes to the given stream
+    void renderExpression(std::string& out) const; // same, but appends the text to out
+    double evaluateExpression(double a, double b) const; // evaluates the expresion tree given values for a and b
+    double evaluateExpression(const double* row) const;  // evaluates with each variable read from its column in row (needs bindVariables)
+    bool bindVariables(const std::vector<std::string>& columns, std::string& error); // resolves variable names to column indices
+    double getScore() const;               // returns the tree's score
+    void setScore(double s);               // sets the tree's score
+    void setScore(double s, double error); // sets an estimated score and the half width of its confidence interval
+    double getScoreError() const;          // returns that half width (0 for an exact score)
+    bool operator<(const LinkedBinaryTree &other) const; // overload operator for comparing trees by score
+    uint64_t canonicalHash() const;        // hash that is equal for trees that always evaluate to the same score
+    Interval bounds(const std::vector<Interval>& domain) const; // range of values when each column lies in its domain
+    bool dependsOn(const Position& p, int column) const; // checks if the subtree at p reads the given column
+    void simplify(const std::vector<Interval>& domain, bool keepZeroSign = true); // shrinks the tree without changing its values
+    void rebalance();                      // regroups chains of + and * into balanced trees (may change rounding)
+    void setConstants(const std::vector<double>& values); // rewrites the numeric literals, in left to right order
+    int height() const;                    // number of nodes on the longest root to leaf path
+
+    // Friend declarations so that the parser and compiler can access private members.
+    friend bool parseExpressionTree(const std::string& postfix, const std::vector<std::string>& columns,
+                                    LinkedBinaryTree& result, std::string& error);
+    friend class CompiledExpression;
+    friend class PersistentTree;
+
+protected:
+    void preorder(Node* v, PositionList &pl) const; // recursive helper for traversal
+    void renderExpression(std::string& out, Node* v) const; // recursive helper to render the expresion tree
+    double evaluateExpression(Node* v, const double* row) const; // recursive helper to evaluate the tree
+    double evaluateExpression(Node* v, double a, double b) const; // recursive helper, matching leaves by name
+    bool bindVariables(Node* v, const std::vector<std::string>& columns, std::string& error); // recursive helper to bind leaves
+    uint64_t canonicalHash(Node* v) const;          // recursive helper to hash a subtree
+    Interval bounds(Node* v, const std::vector<Interval>& domain) const; // recursive helper to bound a subtree
+    bool dependsOn(Node* v, int column) const;      // recursive helper for dependsOn
+    Node* simplify(Node* v, const std::vector<Interval>& domain, bool zeroSign, Interval& range); // recursive helper for simplify
+    static bool sameSubtree(Node* x, Node* y);      // checks if two subtrees are identical
+    Node* makeLiteral(Node* v, double value);       // replaces the subtree at v by a number
+    Node* keepChild(Node* v, Node* child);          // replaces the subtree at v by one of its children
+    Node* rebalance(Node* v);                       // recursive helper for rebalance
+    int height(Node* v) const;                      // recursive helper for height
+    void setConstants(Node* v, const std::vector<double>& values, size_t& next); // recursive helper for setConstants
+    static void collectChain(Node* v, const std::string& op, std::vector<Node*>& operands, std::vector<Node*>& links);
+    Node* buildBalanced(std::vector<Node*>& operands, std::vector<Node*>& links) const;
+
+private:
+    Node* _root;   // pointer to the root node of the tree
+    int n;         // number of nodes in the tree
+    double score;  // score computed from evaluating the tree (average)
+    double scoreError; // half width of the confidence interval when score is estimated from a sample
+
+    //CHATGPT
+    // Helper functions for deep copy and destruction of nodes.
+    Node* clone(Node* v) const;  // recursively clone the tree (CHATGPT was used here to help implement deep copy using recursion)
+    void destroy(Node* v);       // recursively delete nodes in the tree
+    int countNodes(Node* v) const; // count number of nodes in a subtree
+};
+
+//
+// An immutable expression tree whose nodes are reference counted and shared between trees.
+// Copying a PersistentTree copies one pointer, and an edit copies only the nodes on the path from
+// the edited subtree up to the root, sharing everything else with the original. A population of
+// variants of the same trees therefore costs little more memory than the differences between them.
+// Nodes have no parent pointers (a shared node has many parents), so subtrees are addressed by
+// their preorder index instead of by Position. To score a tree, convert it with toTree.
+class PersistentTree {
+public:
+    struct Node;
+    typedef std::shared_ptr<const Node> Ref;
+    struct Node {
+        Elem elt;   // number, operator, or variable
+        int var;    // input column read by a variable leaf, or -1
+        Ref left;
+        Ref right;
+        int count;  // nodes in this subtree
+    };
+
+    PersistentTree() : score(0.0) {}
+    explicit PersistentTree(const LinkedBinaryTree& t);   // copies the nodes of t
+    explicit PersistentTree(const Ref& root) : _root(root), score(0.0) {} // a tree of existing nodes
+    LinkedBinaryTree toTree() const;                     // builds a LinkedBinaryTree with the same nodes and score
+
+    int size() const { return _root ? _root->count : 0; }
+    Ref root() const { return _root; }
+    // Indices below must lie in [0, size()); others throw out_of_range.
+    Ref subtree(int index) const;                        // subtree rooted at the index-th node in preorder
+    PersistentTree replace(int index, const Ref& sub) const; // copy with that subtree replaced by sub (keeps the score)
+    double getScore() const { return score; }
+    void setScore(double s) { score = s; }
+    bool operator<(const PersistentTree& other) const { return score < other.score; }
+
+    static Ref leaf(const Elem& elt, int var);                   // new leaf node
+    static Ref join(const Elem& op, const Ref& left, const Ref& right); // new operator node (right null for abs)
+
+private:
+    static Ref copyFrom(const LinkedBinaryTree::Node* v); // recursive helper for the constructor
+    static LinkedBinaryTree::Node* copyTo(const Ref& v, LinkedBinaryTree::Node* par); // recursive helper for toTree
+    static Ref replace(const Ref& v, int index, const Ref& sub); // recursive helper for replace
+
+    Ref _root;
+    double score;
+};
+
+// Builds the tree for a postfix expression over the named columns.
+// On an invalid expression it returns false and describes the problem in error.
+bool parseExpressionTree(const std::string& postfix, const std::vector<std::string>& columns,
+                         LinkedBinaryTree& result, std::string& error);
+
+#endif
@@ -7,435 +7,3081 @@
 #include <stack>
 #include <cstdlib>
 #include <algorithm>
+#include <unordered_map>
+#include <cstring>
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <chrono>
+#include <csignal>
+#include <cerrno>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <map>
+#include <charconv>
+#include <cmath>
+#include <limits>
+#include <queue>
+#include <random>
+#include <functional>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "expression_tree.h"
+#include "evaluator.h"
+#include "pareto.h"
 using namespace std;
 
-// We use a string to represent the element since it can be a number, an operatr, or a variable
-typedef string Elem;
-
-class LinkedBinaryTree {
-protected:
-    // Node struct holds each node's data and pointers to its parent and children
-    struct Node {
-        Elem elt;       // element: number, operator, or variable
-        Node* par;      // pointer to the parent node
-        Node* left;     // pointer to left child
-        Node* right;    // pointer to right child
-        Node() : elt(""), par(nullptr), left(nullptr), right(nullptr) {} // default constructor
+//*****************************************************
+// Helper Function: Create Expression Tree
+
+// Builds the tree for a postfix expression, exiting with an error message if it is invalid.
+LinkedBinaryTree createExpressionTree(const string& postfix, const vector<string>& columns) {
+    LinkedBinaryTree T;
+    string error;
+    if (!parseExpressionTree(postfix, columns, T, error)) {
+        cerr << error << endl;
+        exit(1);
+    }
+    return T;
+}
+
+//*****************************************************
+// Reading Input Files
+
+//
+// input.txt may start with a header line naming the columns; without one they are named
+// a, b, c, ... in order, so the assignment's two-column files work unchanged.
+
+// Returns the name used for column i of a file without a header.
+string defaultColumnName(size_t i) {
+    return i < 26 ? string(1, char('a' + i)) : "x" + to_string(i + 1);
+}
+
+// Splits a line of input.txt into its space separated fields.
+vector<string> splitFields(const string& line) {
+    vector<string> fields;
+    stringstream ss(line);
+    string str;
+    while (getline(ss, str, ' ')) {
+        if (!str.empty())
+            fields.push_back(str);
+    }
+    return fields;
+}
+
+// Returns true if the line names the columns rather than holding numbers.
+bool isHeader(const vector<string>& fields) {
+    for (auto& f : fields) {
+        try {
+            std::stod(f);
+        } catch (const logic_error&) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns the column names of the input file, reading only its first line.
+// A missing or empty file has the default columns a and b.
+// Binary input files, which the readers below also accept (see Binary Columnar Input).
+bool isBinaryInput(const string& filename);
+vector<string> readBinaryColumnNames(const string& filename);
+Dataset readBinaryDataset(const string& filename, size_t shard, size_t shards);
+
+vector<string> readColumnNames(const string& filename) {
+    if (isBinaryInput(filename))
+        return readBinaryColumnNames(filename);
+    ifstream input_file(filename);
+    string line;
+    while (getline(input_file, line)) {
+        vector<string> fields = splitFields(line);
+        if (fields.empty()) continue; // Skip empty lines
+        if (isHeader(fields))
+            return fields;
+        vector<string> names;
+        for (size_t i = 0; i < fields.size(); i++)
+            names.push_back(defaultColumnName(i));
+        return names;
+    }
+    return {"a", "b"};
+}
+
+// Counts the rows of a text input file (the lines with values, not counting a header).
+size_t countRows(const string& filename) {
+    ifstream input_file(filename);
+    string line;
+    bool first = true;
+    size_t rows = 0;
+    while (getline(input_file, line)) {
+        vector<string> fields = splitFields(line);
+        if (fields.empty()) continue;
+        if (!(first && isHeader(fields)))
+            rows++;
+        first = false;
+    }
+    return rows;
+}
+
+// Reads the input file into columns. Every row must have one value per column.
+// With shards > 1 the rows are split into that many contiguous ranges and only range shard is
+// kept; a text file is then read twice, once to count its rows.
+Dataset readDataset(const string& filename, size_t shard = 0, size_t shards = 1) {
+    if (isBinaryInput(filename))
+        return readBinaryDataset(filename, shard, shards);
+    Dataset data;
+    data.names = readColumnNames(filename);
+    data.columns.resize(data.names.size());
+    size_t from = 0, to = SIZE_MAX;
+    if (shards > 1) {
+        size_t rows = countRows(filename);
+        from = rows * shard / shards;
+        to = rows * (shard + 1) / shards;
+    }
+    ifstream input_file(filename);
+    string line;
+    bool first = true;
+    size_t lineNo = 0, row = 0;
+    while (row < to && getline(input_file, line)) {
+        lineNo++;
+        vector<string> fields = splitFields(line);
+        if (fields.empty()) continue; // Skip empty lines
+        if (first && isHeader(fields)) {
+            first = false;
+            continue;
+        }
+        first = false;
+        if (fields.size() != data.names.size()) {
+            cerr << filename << " line " << lineNo << ": expected " << data.names.size()
+                 << " values but found " << fields.size() << endl;
+            exit(1);
+        }
+        if (row++ < from)
+            continue;
+        for (size_t c = 0; c < fields.size(); c++)
+            data.columns[c].push_back(stod(fields[c]));
+    }
+    input_file.close();
+    return data;
+}
+
+//*****************************************************
+// Persistent Score Cache
+
+//
+// Scores are stored on disk so repeated runs against the same input only evaluate new expressions.
+// Each input dataset gets its own file "<dir>/<dataset hash>.cache", which is an append-only
+// list of fixed size (tree hash, score) records. Writers append whole records under an exclusive
+// flock() so several processes can share one cache directory; readers skip a torn trailing record
+// and the next writer cuts it off.
+class ScoreCache {
+public:
+    ScoreCache(const string& dir, uint64_t datasetHash);
+    bool lookup(uint64_t treeHash, double &score) const; // finds a cached score
+    void insert(uint64_t treeHash, double score);        // queues a new score to be written
+    void flush();                                        // appends all queued scores to disk
+private:
+    struct Record {
+        uint64_t treeHash;
+        double score;
     };
+    string path;                              // cache file for this dataset
+    unordered_map<uint64_t, double> scores;   // scores loaded from disk or computed this run
+    vector<Record> pending;                   // scores not yet written to disk
+};
+
+// Loads all scores previously cached for the dataset.
+ScoreCache::ScoreCache(const string& dir, uint64_t datasetHash) {
+    mkdir(dir.c_str(), 0777); // may already exist
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.cache", (unsigned long long)datasetHash);
+    path = dir + "/" + name;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return; // nothing cached yet
+    flock(fd, LOCK_SH);
+    Record rec;
+    while (read(fd, &rec, sizeof(rec)) == (ssize_t)sizeof(rec))
+        scores[rec.treeHash] = rec.score;
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+bool ScoreCache::lookup(uint64_t treeHash, double &score) const {
+    auto it = scores.find(treeHash);
+    if (it == scores.end()) return false;
+    score = it->second;
+    return true;
+}
+
+void ScoreCache::insert(uint64_t treeHash, double score) {
+    if (scores.emplace(treeHash, score).second)
+        pending.push_back({treeHash, score});
+}
+
+// Appends the queued records with a single write while holding the file lock.
+void ScoreCache::flush() {
+    if (pending.empty()) return;
+    int fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0666);
+    if (fd < 0) {
+        cerr << "Could not open score cache " << path << endl;
+        return;
+    }
+    flock(fd, LOCK_EX);
+    // Cut off a torn record left by a killed writer so our records stay aligned. Padding it instead
+    // would turn its tree hash into an entry with a made-up score.
+    off_t end = lseek(fd, 0, SEEK_END);
+    if (end % sizeof(Record) != 0 && ftruncate(fd, end - end % sizeof(Record)) != 0)
+        cerr << "Could not repair score cache " << path << endl;
+    string buf(reinterpret_cast<const char*>(pending.data()), pending.size() * sizeof(Record));
+    if (write(fd, buf.data(), buf.size()) != (ssize_t)buf.size())
+        cerr << "Could not write score cache " << path << endl;
+    flock(fd, LOCK_UN);
+    close(fd);
+    pending.clear();
+}
+
+// Hashes the column names and the raw bits of every input value,
+// so any change to input.txt selects a new cache file.
+uint64_t hashDataset(const Dataset& data) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t c = 0; c < data.columns.size(); c++) {
+        h = hashCombine(h, hashString(data.names[c]));
+        for (double x : data.columns[c]) {
+            uint64_t bits;
+            memcpy(&bits, &x, sizeof(bits));
+            h = hashCombine(h, bits);
+        }
+    }
+    for (double w : data.weights)
+        h = hashCombine(h, (uint64_t)w);
+    return h;
+}
+
+//
+// Collapses identical rows into one row whose weight is the number of times it occurred, using an
+// open addressing hash table over the rows' bit patterns. Scoring then evaluates each distinct row
+// once and takes the weighted average, which equals the plain average up to rounding.
+Dataset deduplicate(const Dataset& data) {
+    Dataset out;
+    out.names = data.names;
+    out.columns.resize(data.columns.size());
+    size_t N = data.rows();
+    size_t capacity = 16;
+    while (capacity < 2 * N)
+        capacity *= 2;
+    const size_t EMPTY = (size_t)-1;
+    vector<size_t> table(capacity, EMPTY); // index of a distinct row in out
+    for (size_t i = 0; i < N; i++) {
+        uint64_t h = 0;
+        for (auto& column : data.columns) {
+            uint64_t bits;
+            memcpy(&bits, &column[i], sizeof(bits));
+            h = hashCombine(h, bits);
+        }
+        size_t slot = h & (capacity - 1);
+        while (table[slot] != EMPTY) {
+            size_t j = table[slot];
+            bool same = true;
+            for (size_t c = 0; c < data.columns.size() && same; c++)
+                same = memcmp(&out.columns[c][j], &data.columns[c][i], sizeof(double)) == 0;
+            if (same)
+                break;
+            slot = (slot + 1) & (capacity - 1);
+        }
+        if (table[slot] == EMPTY) {
+            table[slot] = out.weights.size();
+            for (size_t c = 0; c < data.columns.size(); c++)
+                out.columns[c].push_back(data.columns[c][i]);
+            out.weights.push_back(0);
+        }
+        out.weights[table[slot]] += data.weight(i);
+    }
+    out.weightTotal = data.count();
+    return out;
+}
+
+//*****************************************************
+// Hoisting Loop Invariants
+
+//
+// Inputs are often grids: b stays fixed while a sweeps its range, then b moves on. Within such a
+// run every subtree that does not read the changing (inner) column has the same value on every row,
+// so a program compiled with that inner column computes those subtrees once per run. Grouping only
+// ever uses consecutive rows, so the sum is taken in file order and the scores are exact.
+
+// The rows of a dataset split into runs of consecutive rows that differ only in the inner column.
+struct RunLayout {
+    int inner;              // the column that changes within a run
+    vector<size_t> starts;  // first row of each run, then the number of rows
+};
+
+static bool sameValue(double x, double y) {
+    return memcmp(&x, &y, sizeof(double)) == 0;
+}
+
+// Picks the column that changes most often between consecutive rows as the inner one
+// and splits the rows wherever any other column changes.
+RunLayout findRuns(const Dataset& data) {
+    RunLayout runs;
+    size_t N = data.rows();
+    vector<size_t> changes(data.columns.size(), 0);
+    for (size_t c = 0; c < data.columns.size(); c++)
+        for (size_t i = 1; i < N; i++)
+            if (!sameValue(data.columns[c][i], data.columns[c][i - 1]))
+                changes[c]++;
+    runs.inner = changes.empty() ? -1 : max_element(changes.begin(), changes.end()) - changes.begin();
+    for (size_t i = 0; i < N; i++) {
+        bool split = (i == 0);
+        for (size_t c = 0; c < data.columns.size() && !split; c++)
+            if ((int)c != runs.inner && !sameValue(data.columns[c][i], data.columns[c][i - 1]))
+                split = true;
+        if (split)
+            runs.starts.push_back(i);
+    }
+    runs.starts.push_back(N);
+    return runs;
+}
+
+// Scores a program compiled for runs.inner, evaluating each run (in blocks) as one batch.
+double scoreRuns(const CompiledExpression& code, const Dataset& data, const RunLayout& runs) {
+    double out[CompiledExpression::BLOCK];
+    double sum = 0;
+    for (size_t r = 0; r + 1 < runs.starts.size(); r++) {
+        for (size_t start = runs.starts[r]; start < runs.starts[r + 1]; start += CompiledExpression::BLOCK) {
+            size_t m = min(CompiledExpression::BLOCK, runs.starts[r + 1] - start);
+            code.evaluateRange(data, start, m, out);
+            addOutputs(data, start, m, out, sum);
+        }
+    }
+    return sum / data.count();
+}
+
+// One axis of an implicit grid: n evenly spaced values from lo to hi.
+struct GridAxis {
+    string name;
+    double lo;
+    double hi;
+    size_t n;
+    double value(size_t i) const { return n > 1 ? lo + (hi - lo) * i / (n - 1) : lo; }
+};
+
+// Parses a grid like "b=0:10:11,a=-1:1:201". Rows run through the axes like nested loops,
+// the last axis changing fastest.
+vector<GridAxis> parseGrid(const string& spec) {
+    vector<GridAxis> grid;
+    stringstream ss(spec);
+    string part;
+    while (getline(ss, part, ',')) {
+        GridAxis axis;
+        size_t eq = part.find('=');
+        char name[64];
+        if (eq == string::npos || eq == 0 || eq >= sizeof(name)
+            || sscanf(part.c_str() + eq + 1, "%lf:%lf:%zu", &axis.lo, &axis.hi, &axis.n) != 3 || axis.n == 0) {
+            cerr << "Invalid grid axis \"" << part << "\" (expected name=lo:hi:n)" << endl;
+            exit(1);
+        }
+        axis.name = part.substr(0, eq);
+        grid.push_back(axis);
+    }
+    if (grid.empty()) {
+        cerr << "Empty grid" << endl;
+        exit(1);
+    }
+    return grid;
+}
+
+// Returns the names of the grid's axes, which are the variables expressions may use.
+vector<string> gridNames(const vector<GridAxis>& grid) {
+    vector<string> names;
+    for (auto& axis : grid)
+        names.push_back(axis.name);
+    return names;
+}
+
+// Hashes the grid's axes, which identify its rows just as hashDataset does for a file.
+uint64_t hashGrid(const vector<GridAxis>& grid) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL;
+    for (auto& axis : grid) {
+        uint64_t lo, hi;
+        memcpy(&lo, &axis.lo, sizeof(lo));
+        memcpy(&hi, &axis.hi, sizeof(hi));
+        h = hashCombine(hashCombine(hashCombine(hashCombine(h, hashString(axis.name)), lo), hi), axis.n);
+    }
+    return h;
+}
+
+// Writes out every row of the grid, for the modes that need a real dataset.
+Dataset materializeGrid(const vector<GridAxis>& grid) {
+    Dataset data;
+    data.names = gridNames(grid);
+    data.columns.resize(grid.size());
+    vector<size_t> index(grid.size(), 0);
+    while (true) {
+        for (size_t c = 0; c < grid.size(); c++)
+            data.columns[c].push_back(grid[c].value(index[c]));
+        size_t c = grid.size();
+        while (c > 0 && ++index[c - 1] == grid[c - 1].n)
+            index[--c] = 0;
+        if (c == 0)
+            break;
+    }
+    return data;
+}
+
+// Scores a program compiled with the last axis as its inner column over the grid, generating the
+// rows on the fly instead of storing them. Each run sweeps the last axis with the others fixed.
+double scoreGrid(const CompiledExpression& code, const vector<GridAxis>& grid) {
+    const size_t BLOCK = CompiledExpression::BLOCK;
+    size_t last = grid.size() - 1;
+    vector<double> inner(grid[last].n);
+    for (size_t i = 0; i < inner.size(); i++)
+        inner[i] = grid[last].value(i);
+    vector<vector<double> > fixed(last, vector<double>(BLOCK)); // the outer axes, one value repeated
+    vector<const double*> columns(grid.size());
+    for (size_t c = 0; c < last; c++)
+        columns[c] = fixed[c].data();
+
+    double out[BLOCK];
+    double sum = 0, rows = 0;
+    vector<size_t> index(last, 0);
+    while (true) {
+        for (size_t c = 0; c < last; c++)
+            fill(fixed[c].begin(), fixed[c].end(), grid[c].value(index[c]));
+        for (size_t start = 0; start < inner.size(); start += BLOCK) {
+            size_t m = min(BLOCK, inner.size() - start);
+            columns[last] = inner.data() + start;
+            code.evaluateBatch(columns.data(), m, out);
+            for (size_t i = 0; i < m; i++)
+                sum += out[i];
+        }
+        rows += inner.size();
+        size_t c = last;
+        while (c > 0 && ++index[c - 1] == grid[c - 1].n)
+            index[--c] = 0;
+        if (c == 0)
+            break;
+    }
+    return sum / rows;
+}
+
+//*****************************************************
+// Writing Results
+
+// Appends a score formatted exactly as "cout << score" prints it (six significant digits),
+// using to_chars instead of the much slower stream machinery.
+void appendScore(string& out, double score) {
+    char buf[32];
+    auto res = to_chars(buf, buf + sizeof(buf), score, chars_format::general, 6);
+    out.append(buf, res.ptr);
+}
+
+// Appends the "Exp ... Score ..." line main prints for a tree.
+void appendResultLine(string& out, const LinkedBinaryTree& t) {
+    out += "Exp ";
+    t.renderExpression(out);
+    out += " Score ";
+    appendScore(out, t.getScore());
+    out += '\n';
+}
+
+// Writes all of buf to fd, returning false if the other side went away.
+bool writeAll(int fd, const string& buf) {
+    size_t done = 0;
+    while (done < buf.size()) {
+        ssize_t put = write(fd, buf.data() + done, buf.size() - done);
+        if (put < 0 && errno == EINTR)
+            continue;
+        if (put <= 0)
+            return false;
+        done += put;
+    }
+    return true;
+}
+
+// Runs job(0), ..., job(jobs - 1) at the same time: job 0 on the calling thread and each of the
+// others on a thread of its own. Returns when all of them have finished.
+void runParallel(size_t jobs, const function<void(size_t)>& job) {
+    vector<thread> pool;
+    for (size_t j = 1; j < jobs; j++)
+        pool.emplace_back(job, j);
+    if (jobs > 0) job(0);
+    for (auto& t : pool)
+        t.join();
+}
+
+//
+// Writes the result lines for the trees, in order, to fd. Lines are rendered a chunk at a time into
+// memory, with the chunk split into shards that are rendered in parallel, and each shard is then
+// written with one system call. The text is the same as printing each tree with cout.
+// With an order, the trees are printed in that order instead.
+bool writeResults(int fd, const vector<LinkedBinaryTree>& trees, int threads,
+                  const vector<uint32_t>* order = nullptr) {
+    const size_t CHUNK = 1 << 16;        // lines held in memory at once
+    const size_t MIN_SHARD = 1 << 12;    // fewer lines than this are not worth a thread
+    for (size_t start = 0; start < trees.size(); start += CHUNK) {
+        size_t end = min(trees.size(), start + CHUNK);
+        size_t shards = max<size_t>(1, min<size_t>(threads, (end - start) / MIN_SHARD));
+        vector<string> bufs(shards);
+        runParallel(shards, [&](size_t s) {
+            size_t from = start + (end - start) * s / shards;
+            size_t to = start + (end - start) * (s + 1) / shards;
+            for (size_t k = from; k < to; k++)
+                appendResultLine(bufs[s], trees[order != nullptr ? (*order)[k] : k]);
+        });
+        for (auto& buf : bufs)
+            if (!writeAll(fd, buf))
+                return false;
+    }
+    return true;
+}
+
+//*****************************************************
+// Binary Columnar Input
+
+//
+// A binary input file holds each column as one contiguous, 64-byte aligned array, so it can be
+// mapped into memory and evaluated in place with no parsing. readDataset and readColumnNames
+// recognize it by its magic number, so a converted file can simply take input.txt's place.
+// float64 columns are used straight from the mapping; float32 columns (half the size) and files
+// read by a row shard are copied into memory. Values are stored in the machine's byte order.
+//
+// Layout: a BinaryHeader, then one BinaryColumn entry per column, then the column arrays.
+// With the checksum flag set, each entry carries a hash of its array's bytes, which is checked
+// on loading (reading the whole file once).
+
+static const char BINARY_MAGIC[8] = {'A', 'S', 'S', '4', 'C', 'O', 'L', 'S'};
+
+struct BinaryHeader {
+    char magic[8];
+    uint32_t version;  // 1
+    uint32_t columns;
+    uint64_t rows;
+    uint32_t flags;    // BINARY_CHECKSUMS
+    uint32_t reserved;
+};
+
+struct BinaryColumn {
+    char name[48];     // NUL padded
+    uint32_t type;     // BINARY_FLOAT64 or BINARY_FLOAT32
+    uint32_t reserved;
+    uint64_t offset;   // from the start of the file
+    uint64_t checksum; // when the header has BINARY_CHECKSUMS
+};
+
+enum { BINARY_FLOAT64 = 0, BINARY_FLOAT32 = 1 };
+enum { BINARY_CHECKSUMS = 1 };
+
+// Hashes bytes as 64-bit words, the last one padded with zeros.
+static uint64_t hashBytes(const char* p, size_t n) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < n; i += 8) {
+        uint64_t word = 0;
+        memcpy(&word, p + i, min<size_t>(8, n - i));
+        h = hashCombine(h, word);
+    }
+    return h;
+}
+
+bool isBinaryInput(const string& filename) {
+    char magic[8];
+    ifstream in(filename, ios::binary);
+    return in.read(magic, sizeof(magic)) && memcmp(magic, BINARY_MAGIC, sizeof(magic)) == 0;
+}
+
+// Reads the column names from the entries of a binary input file.
+vector<string> readBinaryColumnNames(const string& filename) {
+    ifstream in(filename, ios::binary);
+    BinaryHeader header;
+    in.read(reinterpret_cast<char*>(&header), sizeof(header));
+    vector<string> names;
+    for (uint32_t c = 0; c < header.columns && in; c++) {
+        BinaryColumn entry;
+        in.read(reinterpret_cast<char*>(&entry), sizeof(entry));
+        names.push_back(string(entry.name, strnlen(entry.name, sizeof(entry.name))));
+    }
+    if (!in) {
+        cerr << filename << ": truncated header" << endl;
+        exit(1);
+    }
+    return names;
+}
+
+// Maps a binary input file and makes its columns. With shards > 1 only the shard-th of that many
+// contiguous ranges of rows is kept.
+Dataset readBinaryDataset(const string& filename, size_t shard, size_t shards) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(filename.c_str());
+        exit(1);
+    }
+    size_t length = st.st_size;
+    void* addr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        perror(filename.c_str());
+        exit(1);
+    }
+    Dataset data;
+    data.mapping = shared_ptr<const void>(addr, [length](const void* p) { munmap(const_cast<void*>(p), length); });
+    const char* base = static_cast<const char*>(addr);
+
+    auto corrupt = [&](const string& why) {
+        cerr << filename << ": " << why << endl;
+        exit(1);
+    };
+    if (length < sizeof(BinaryHeader))
+        corrupt("truncated header");
+    BinaryHeader header;
+    memcpy(&header, base, sizeof(header));
+    if (header.version != 1)
+        corrupt("unsupported version " + to_string(header.version));
+    if (length < sizeof(BinaryHeader) + header.columns * sizeof(BinaryColumn))
+        corrupt("truncated header");
+    data.names = readBinaryColumnNames(filename);
+    data.columns.resize(header.columns);
+    for (uint32_t c = 0; c < header.columns; c++) {
+        BinaryColumn entry;
+        memcpy(&entry, base + sizeof(BinaryHeader) + c * sizeof(BinaryColumn), sizeof(entry));
+        size_t width = entry.type == BINARY_FLOAT32 ? sizeof(float) : sizeof(double);
+        if (entry.type != BINARY_FLOAT64 && entry.type != BINARY_FLOAT32)
+            corrupt("column " + data.names[c] + " has unknown type " + to_string(entry.type));
+        if (entry.offset % 64 != 0 || entry.offset > length || (length - entry.offset) / width < header.rows)
+            corrupt("column " + data.names[c] + " lies outside the file");
+        const char* p = base + entry.offset;
+        if ((header.flags & BINARY_CHECKSUMS) && hashBytes(p, header.rows * width) != entry.checksum)
+            corrupt("checksum mismatch in column " + data.names[c]);
+
+        size_t from = header.rows * shard / shards, to = header.rows * (shard + 1) / shards;
+        if (entry.type == BINARY_FLOAT64) {
+            data.columns[c].setView(reinterpret_cast<const double*>(p) + from, to - from);
+            continue;
+        }
+        for (size_t row = from; row < to; row++) {
+            float x;
+            memcpy(&x, p + row * sizeof(float), sizeof(float));
+            data.columns[c].push_back(x);
+        }
+    }
+    return data;
+}
+
+// Converts the text input file to a binary one, with float32 columns if asked (which rounds the
+// values) and with checksums if asked.
+int convertInput(const string& textFile, const string& binaryFile, bool float32, bool checksums) {
+    Dataset data = readDataset(textFile);
+    for (auto& name : data.names)
+        if (name.size() >= sizeof(BinaryColumn::name)) {
+            cerr << "Column name " << name << " is too long for the binary format" << endl;
+            return 1;
+        }
+    BinaryHeader header = {};
+    memcpy(header.magic, BINARY_MAGIC, sizeof(header.magic));
+    header.version = 1;
+    header.columns = data.names.size();
+    header.rows = data.rows();
+    header.flags = checksums ? BINARY_CHECKSUMS : 0;
+
+    // Lay out the arrays after the header, each starting on a 64-byte boundary.
+    size_t width = float32 ? sizeof(float) : sizeof(double);
+    size_t offset = sizeof(BinaryHeader) + header.columns * sizeof(BinaryColumn);
+    vector<BinaryColumn> entries(header.columns);
+    vector<string> arrays(header.columns);
+    for (size_t c = 0; c < header.columns; c++) {
+        offset = (offset + 63) / 64 * 64;
+        BinaryColumn& entry = entries[c];
+        memset(&entry, 0, sizeof(entry));
+        memcpy(entry.name, data.names[c].data(), data.names[c].size());
+        entry.type = float32 ? BINARY_FLOAT32 : BINARY_FLOAT64;
+        entry.offset = offset;
+        if (float32) {
+            vector<float> values(data.columns[c].begin(), data.columns[c].end());
+            arrays[c].assign(reinterpret_cast<const char*>(values.data()), values.size() * width);
+        } else {
+            arrays[c].assign(reinterpret_cast<const char*>(data.columns[c].data()), data.rows() * width);
+        }
+        if (checksums)
+            entry.checksum = hashBytes(arrays[c].data(), arrays[c].size());
+        offset += arrays[c].size();
+    }
+
+    int fd = open(binaryFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        perror(binaryFile.c_str());
+        return 1;
+    }
+    string buf(reinterpret_cast<const char*>(&header), sizeof(header));
+    buf.append(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(BinaryColumn));
+    bool ok = writeAll(fd, buf);
+    for (size_t c = 0; c < header.columns && ok; c++) {
+        ok = writeAll(fd, string(entries[c].offset - (c == 0 ? buf.size() : entries[c - 1].offset + arrays[c - 1].size()), '\0'))
+             && writeAll(fd, arrays[c]);
+    }
+    close(fd);
+    if (!ok) {
+        cerr << "Could not write " << binaryFile << endl;
+        return 1;
+    }
+    cerr << "Wrote " << header.rows << " rows of " << header.columns << " columns to " << binaryFile << endl;
+    return 0;
+}
+
+//*****************************************************
+// Parallel Ranking
+
+//
+// Sorting vector<LinkedBinaryTree> moves whole trees around. With --stable-sort the trees stay in
+// place: a compact array of (score key, node count, file position) entries is sorted instead, and
+// the results are printed through the resulting permutation. Scores are mapped to integer keys that
+// order like the doubles (with -0 equal to 0 and NaN last), and ties are broken by node count and
+// then file position, so the order is fully determined. Each thread sorts one slice of the array
+// and the sorted slices are then merged pairwise. Every merge is split at co-ranked positions into
+// pieces that are merged independently, so each round (the last one too) keeps all threads busy.
+
+struct RankEntry {
+    uint64_t key;   // score mapped to an unsigned integer with the same order
+    uint32_t nodes; // node count (smaller trees first on ties)
+    uint32_t index; // position in expressions.txt
+    bool operator<(const RankEntry& o) const {
+        if (key != o.key) return key < o.key;
+        if (nodes != o.nodes) return nodes < o.nodes;
+        return index < o.index;
+    }
+};
+
+// Maps a score to an integer key: flipping the sign bit of positive doubles and all bits of
+// negative ones makes unsigned comparison agree with comparing the doubles.
+uint64_t scoreKey(double s) {
+    if (isnan(s)) return UINT64_MAX;
+    if (s == 0) s = 0; // -0 ranks with 0
+    uint64_t bits;
+    memcpy(&bits, &s, sizeof(bits));
+    return (bits >> 63) ? ~bits : bits | (uint64_t(1) << 63);
+}
+
+// Returns how many of the first k entries of the merge of sorted a[0..na) and b[0..nb) come from
+// a, by binary search along the merge path. Entries are never equal, so the split is exact.
+size_t coRank(const RankEntry* a, size_t na, const RankEntry* b, size_t nb, size_t k) {
+    size_t lo = k > nb ? k - nb : 0, hi = min(k, na);
+    while (lo < hi) {
+        size_t mid = (lo + hi + 1) / 2;
+        if (a[mid - 1] < b[k - mid])
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+// Returns the tree positions sorted by score (lowest first), ties broken by node count and then
+// file position.
+vector<uint32_t> rankTrees(const vector<LinkedBinaryTree>& trees, int threads) {
+    size_t n = trees.size();
+    if (n > UINT32_MAX) {
+        cerr << "Too many trees to rank" << endl;
+        exit(1);
+    }
+    const size_t MIN_SLICE = 1 << 14; // fewer entries than this are not worth a thread
+    size_t slices = max<size_t>(1, min<size_t>(threads, n / MIN_SLICE));
+    vector<RankEntry> entries(n), merged(n);
+    vector<size_t> bounds(slices + 1);
+    for (size_t s = 0; s <= slices; s++)
+        bounds[s] = n * s / slices;
+
+    runParallel(slices, [&](size_t s) {
+        for (size_t i = bounds[s]; i < bounds[s + 1]; i++)
+            entries[i] = {scoreKey(trees[i].getScore()), uint32_t(trees[i].size()), uint32_t(i)};
+        sort(entries.begin() + bounds[s], entries.begin() + bounds[s + 1]);
+    });
+    // Merge neighbouring runs of sorted slices until one run remains.
+    for (size_t width = 1; width < slices; width *= 2) {
+        size_t pairs = (slices + 2 * width - 1) / (2 * width);
+        size_t pieces = (slices + pairs - 1) / pairs; // per merge
+        runParallel(pairs * pieces, [&](size_t j) {
+            size_t p = j / pieces, q = j % pieces;
+            size_t lo = bounds[p * 2 * width];
+            size_t mid = bounds[min(slices, p * 2 * width + width)];
+            size_t hi = bounds[min(slices, p * 2 * width + 2 * width)];
+            const RankEntry* a = entries.data() + lo;
+            const RankEntry* b = entries.data() + mid;
+            size_t k0 = (hi - lo) * q / pieces, k1 = (hi - lo) * (q + 1) / pieces;
+            size_t i0 = coRank(a, mid - lo, b, hi - mid, k0);
+            size_t i1 = coRank(a, mid - lo, b, hi - mid, k1);
+            merge(a + i0, a + i1, b + (k0 - i0), b + (k1 - i1), merged.begin() + lo + k0);
+        });
+        entries.swap(merged);
+    }
+
+    vector<uint32_t> order(n);
+    for (size_t i = 0; i < n; i++)
+        order[i] = entries[i].index;
+    return order;
+}
+
+//*****************************************************
+// Scoring Server
+
+//
+// The server loads input.txt once and then scores batches of expressions sent over a Unix socket.
+// Protocol (text, one expression per line):
+//  - the client sends postfix expressions, and an empty line ends a batch,
+//  - the server replies with one "Exp ... Score ..." line per expression in ranking order
+//    (the same lines main prints), then an "Error ..." line for each invalid expression,
+//    and finally an empty line.
+// A connection may send any number of batches. Each connection is served on its own thread, up to
+// MAX_CONNECTIONS at once; further clients wait to be accepted until one of those hangs up.
+
+// Reads newline-terminated lines from a file descriptor through a buffer.
+class LineReader {
+public:
+    LineReader(int _fd) : fd(_fd), pos(0) {}
+    bool readLine(string& line); // returns false at the end of the stream
+private:
+    int fd;
+    string buf;  // data read but not yet returned
+    size_t pos;  // start of the unread part of buf
+};
+
+bool LineReader::readLine(string& line) {
+    while (true) {
+        size_t nl = buf.find('\n', pos);
+        if (nl != string::npos) {
+            line.assign(buf, pos, nl - pos);
+            pos = nl + 1;
+            return true;
+        }
+        buf.erase(0, pos);
+        pos = 0;
+        char chunk[65536];
+        ssize_t got = read(fd, chunk, sizeof(chunk));
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0) {
+            // Return a final line that has no newline.
+            if (buf.empty()) return false;
+            line = buf;
+            buf.clear();
+            return true;
+        }
+        buf.append(chunk, got);
+    }
+}
+
+// Scores one batch and formats the reply. The time taken for each expression
+// (parse, compile and evaluate) is added to latencies, in microseconds.
+string scoreBatch(const vector<string>& batch, const Dataset& data, vector<double>& latencies) {
+    vector<LinkedBinaryTree> trees;
+    vector<string> errors;
+    for (size_t k = 0; k < batch.size(); k++) {
+        auto start = chrono::steady_clock::now();
+        LinkedBinaryTree T;
+        string error;
+        if (!parseExpressionTree(batch[k], data.names, T, error)) {
+            errors.push_back("Error line " + to_string(k + 1) + ": " + error);
+            continue;
+        }
+        T.setScore(CompiledExpression(T).score(data));
+        trees.push_back(T);
+        latencies.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - start).count());
+    }
+    sort(trees.begin(), trees.end());
+
+    string reply;
+    for (auto& t : trees)
+        appendResultLine(reply, t);
+    for (auto& e : errors) {
+        reply += e;
+        reply += '\n';
+    }
+    reply += '\n';
+    return reply;
+}
+
+// Handles one client connection until it closes.
+void serveConnection(int conn, const Dataset& data) {
+    LineReader reader(conn);
+    vector<string> batch;
+    string line;
+    bool more = true;
+    while (more) {
+        more = reader.readLine(line);
+        if (more && !line.empty()) {
+            batch.push_back(line);
+            continue;
+        }
+        if (!more && batch.empty())
+            break;
+        vector<double> latencies;
+        if (!writeAll(conn, scoreBatch(batch, data, latencies)))
+            break;
+        if (!latencies.empty()) {
+            // One write per report, so the reports of concurrent connections do not interleave.
+            sort(latencies.begin(), latencies.end());
+            ostringstream report;
+            report << "Scored " << latencies.size() << " expressions: p50 "
+                   << latencies[latencies.size() / 2] << " us, p99 "
+                   << latencies[latencies.size() * 99 / 100] << " us\n";
+            cerr << report.str();
+        }
+        batch.clear();
+    }
+}
+
+// Opens a Unix stream socket at path, either listening on it (server) or connected to it (client).
+int openUnixSocket(const string& path, bool listening) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        cerr << "Socket path too long: " << path << endl;
+        return -1;
+    }
+    strcpy(addr.sun_path, path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (listening) {
+        unlink(path.c_str()); // remove a socket left by an earlier server
+        if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+            perror(path.c_str());
+            close(fd);
+            return -1;
+        }
+    } else if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror(path.c_str());
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Serves clients until the process is killed, each connection on its own thread, so a client that
+// is slow to send its batch never holds up the others. The dataset is only read, so the threads
+// share it.
+static const int MAX_CONNECTIONS = 64;
+
+int runServer(const string& path, const Dataset& data) {
+    signal(SIGPIPE, SIG_IGN); // a client hanging up must not kill the server
+    int listener = openUnixSocket(path, true);
+    if (listener < 0)
+        return 1;
+    cerr << "Serving " << data.rows() << " input rows on " << path << endl;
+    mutex m;
+    condition_variable changed;
+    int active = 0; // connections being served
+    while (true) {
+        {
+            unique_lock<mutex> lock(m);
+            changed.wait(lock, [&] { return active < MAX_CONNECTIONS; });
+        }
+        int conn = accept(listener, nullptr, nullptr);
+        if (conn < 0) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            break;
+        }
+        {
+            lock_guard<mutex> lock(m);
+            active++;
+        }
+        thread([conn, &data, &m, &changed, &active] {
+            serveConnection(conn, data);
+            close(conn);
+            lock_guard<mutex> lock(m);
+            active--;
+            changed.notify_all();
+        }).detach();
+    }
+    close(listener);
+    // The connections still open read data, which belongs to the caller, so wait for them.
+    unique_lock<mutex> lock(m);
+    changed.wait(lock, [&] { return active == 0; });
+    return 1;
+}
+
+// Sends the expressions read from standard input to the server as one batch
+// and prints the reply, which matches what main prints for the same expressions.
+int runClient(const string& path) {
+    int fd = openUnixSocket(path, false);
+    if (fd < 0)
+        return 1;
+    string request, line;
+    while (getline(cin, line)) {
+        if (line.empty()) continue;
+        request += line;
+        request += '\n';
+    }
+    request += '\n';
+    if (!writeAll(fd, request)) {
+        cerr << "Could not send request to " << path << endl;
+        close(fd);
+        return 1;
+    }
+    LineReader reader(fd);
+    while (reader.readLine(line) && !line.empty())
+        cout << line << '\n';
+    close(fd);
+    return 0;
+}
+
+//*****************************************************
+// Pipelined Scoring
+
+//
+// A bounded multi-producer multi-consumer queue that never takes a lock (Dmitry Vyukov's design).
+// Every cell carries a sequence number telling whether it is ready to be written or read,
+// so producers and consumers only race on the head and tail counters.
+template <typename T>
+class BoundedQueue {
 public:
-    // The Position class gives a user-friendly handle to a Node pointer.
-    class Position {
-    private:
-        Node* v; // pointer to the node in the tree
-    public:
-        Position(Node* _v = nullptr) : v(_v) {}
-        Elem& operator*() { return v->elt; } // overloaded * operator to access the element
-        Position left() const { return Position(v->left); }  // get left child position
-        Position right() const { return Position(v->right); } // get right child position
-        Position parent() const { return Position(v->par); }  // get parent position
-        bool isRoot() const { return v->par == nullptr; }     // check if this is root
-        bool isExternal() const { return v->left == nullptr && v->right == nullptr; } // check if a leaf
-        friend class LinkedBinaryTree;
+    explicit BoundedQueue(size_t capacity);
+    bool tryPush(const T& item); // returns false if the queue is full
+    bool tryPop(T& item);        // returns false if the queue is empty
+private:
+    struct Cell {
+        atomic<size_t> seq;
+        T item;
     };
-    typedef list<Position> PositionList;
+    unique_ptr<Cell[]> cells;
+    size_t mask;                        // capacity - 1 (capacity is a power of two)
+    alignas(64) atomic<size_t> head;    // next position to pop
+    alignas(64) atomic<size_t> tail;    // next position to push
+};
+
+template <typename T>
+BoundedQueue<T>::BoundedQueue(size_t capacity) : head(0), tail(0) {
+    size_t size = 2;
+    while (size < capacity)
+        size *= 2;
+    cells.reset(new Cell[size]);
+    mask = size - 1;
+    for (size_t i = 0; i < size; i++)
+        cells[i].seq.store(i, memory_order_relaxed);
+}
+
+template <typename T>
+bool BoundedQueue<T>::tryPush(const T& item) {
+    size_t pos = tail.load(memory_order_relaxed);
+    while (true) {
+        Cell& c = cells[pos & mask];
+        size_t seq = c.seq.load(memory_order_acquire);
+        if (seq == pos) {
+            if (tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                c.item = item;
+                c.seq.store(pos + 1, memory_order_release);
+                return true;
+            }
+        } else if (seq < pos) {
+            return false; // the cell still holds an item from the previous lap
+        } else {
+            pos = tail.load(memory_order_relaxed);
+        }
+    }
+}
+
+template <typename T>
+bool BoundedQueue<T>::tryPop(T& item) {
+    size_t pos = head.load(memory_order_relaxed);
+    while (true) {
+        Cell& c = cells[pos & mask];
+        size_t seq = c.seq.load(memory_order_acquire);
+        if (seq == pos + 1) {
+            if (head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                item = c.item;
+                c.seq.store(pos + mask + 1, memory_order_release);
+                return true;
+            }
+        } else if (seq < pos + 1) {
+            return false; // nothing has been pushed here yet
+        } else {
+            pos = head.load(memory_order_relaxed);
+        }
+    }
+}
+
+// A tree travelling through the pipeline along with its line number in expressions.txt.
+struct PipelineItem {
+    size_t index;
+    LinkedBinaryTree* tree;
+};
+
+//
+// Runs the three stages at the same time:
+//  1. a reader thread parses expressions.txt and queues the trees,
+//  2. a pool of workers scores them against input.txt,
+//  3. the calling thread formats results and writes them in file order.
+// Output starts as soon as the first expressions are scored, so the trees are printed in
+// file order instead of sorted by score (sorting would have to wait for the last tree).
+// Each line is the same "Exp ... Score ..." line main prints, and the lines are written to fd.
+int runPipeline(int workers, int fd) {
+    BoundedQueue<PipelineItem> parsed(1024), scored(1024);
+    atomic<bool> readerDone(false);
+    atomic<int> workersLeft(workers);
+
+    // Stage 1: read and parse. Starts before input.txt is loaded so the two reads overlap;
+    // only the header of input.txt is needed to bind the variables.
+    thread reader([&]() {
+        vector<string> columns = readColumnNames("input.txt");
+        ifstream exp_file("expressions.txt");
+        string line;
+        size_t index = 0;
+        while (getline(exp_file, line)) {
+            if (line.empty()) continue;
+            PipelineItem item = {index++, new LinkedBinaryTree(createExpressionTree(line, columns))};
+            while (!parsed.tryPush(item))
+                this_thread::yield();
+        }
+        readerDone.store(true, memory_order_release);
+    });
+
+    Dataset data = readDataset("input.txt");
+
+    // Stage 2: score on the worker pool.
+    vector<thread> pool;
+    for (int w = 0; w < workers; w++) {
+        pool.emplace_back([&]() {
+            PipelineItem item;
+            while (true) {
+                if (!parsed.tryPop(item)) {
+                    if (!readerDone.load(memory_order_acquire)) {
+                        this_thread::yield();
+                        continue;
+                    }
+                    if (!parsed.tryPop(item))
+                        break; // the reader has finished and the queue is drained
+                }
+                item.tree->setScore(CompiledExpression(*item.tree).score(data));
+                while (!scored.tryPush(item))
+                    this_thread::yield();
+            }
+            workersLeft.fetch_sub(1, memory_order_release);
+        });
+    }
+
+    // Stage 3: put the results back in file order and write them in large chunks.
+    // The buffer is also flushed whenever the workers have nothing ready, so results show up promptly.
+    map<size_t, LinkedBinaryTree*> waiting;
+    size_t next = 0;
+    string out;
+    PipelineItem item;
+    while (true) {
+        if (!scored.tryPop(item)) {
+            if (!out.empty()) {
+                writeAll(fd, out);
+                out.clear();
+            }
+            if (workersLeft.load(memory_order_acquire) > 0) {
+                this_thread::yield();
+                continue;
+            }
+            if (!scored.tryPop(item))
+                break;
+        }
+        waiting[item.index] = item.tree;
+        while (!waiting.empty() && waiting.begin()->first == next) {
+            LinkedBinaryTree* t = waiting.begin()->second;
+            appendResultLine(out, *t);
+            delete t;
+            waiting.erase(waiting.begin());
+            next++;
+        }
+        if (out.size() >= 1 << 16) {
+            writeAll(fd, out);
+            out.clear();
+        }
+    }
+    writeAll(fd, out);
+
+    reader.join();
+    for (auto& w : pool)
+        w.join();
+    return 0;
+}
+
+//*****************************************************
+// Top-K Selection
+
+// Returns the range of the non-NaN values in a column, noting whether any NaN was seen.
+Interval columnDomain(const Column& column) {
+    Interval d = {numeric_limits<double>::infinity(), -numeric_limits<double>::infinity(), false};
+    for (double x : column) {
+        if (isnan(x)) {
+            d.mayBeNaN = true;
+        } else {
+            d.lo = min(d.lo, x);
+            d.hi = max(d.hi, x);
+        }
+    }
+    if (d.lo > d.hi) // no numbers at all
+        return {-numeric_limits<double>::infinity(), numeric_limits<double>::infinity(), true};
+    return d;
+}
+
+//
+// Finds the k trees with the highest scores and returns them sorted like main prints them
+// (lowest first), so the output equals the last k lines of the full listing.
+// Trees whose score is NaN are never selected, since they have no place in the ranking.
+//
+// With prune set, the bounds of every tree over the input domain are computed first and the trees
+// are scored from the highest upper bound down. Once k trees are held, the remaining trees whose
+// upper bound is below the k-th best score cannot get in and are skipped without being evaluated.
+vector<LinkedBinaryTree> selectTopK(const vector<LinkedBinaryTree>& trees, const Dataset& data,
+                                    size_t k, bool prune) {
+    vector<Interval> domain;
+    for (auto& column : data.columns)
+        domain.push_back(columnDomain(column));
+    vector<double> upper(trees.size(), numeric_limits<double>::infinity());
+    vector<size_t> order(trees.size());
+    for (size_t i = 0; i < trees.size(); i++) {
+        order[i] = i;
+        if (prune) {
+            Interval bound = trees[i].bounds(domain);
+            // The average of values in [lo, hi] is in [lo, hi] up to the rounding of the sum.
+            double slack = (fabs(bound.lo) + fabs(bound.hi)) * data.count() * numeric_limits<double>::epsilon();
+            upper[i] = bound.hi + slack;
+        }
+    }
+    if (prune)
+        stable_sort(order.begin(), order.end(), [&](size_t x, size_t y) { return upper[x] > upper[y]; });
+
+    // Min-heap of (score, tree index) holding the best k trees seen so far.
+    priority_queue<pair<double, size_t>, vector<pair<double, size_t> >, greater<pair<double, size_t> > > best;
+    size_t evaluated = 0;
+    for (size_t i : order) {
+        if (k == 0 || (best.size() == k && upper[i] < best.top().first))
+            break; // every remaining tree has a lower upper bound
+        double score = CompiledExpression(trees[i]).score(data);
+        evaluated++;
+        if (isnan(score))
+            continue;
+        if (best.size() < k) {
+            best.push({score, i});
+        } else if (score > best.top().first) {
+            best.pop();
+            best.push({score, i});
+        }
+    }
+    if (prune)
+        cerr << "Evaluated " << evaluated << " of " << trees.size() << " trees" << endl;
+
+    vector<LinkedBinaryTree> result;
+    for (; !best.empty(); best.pop()) {
+        result.push_back(trees[best.top().second]);
+        result.back().setScore(best.top().first);
+    }
+    sort(result.begin(), result.end());
+    return result;
+}
+
+//*****************************************************
+// Racing Selection
+
+//
+// Finds (approximately) the k trees with the highest scores without scoring every tree on every row.
+// The rows are shuffled once, and in each round the surviving trees are scored on a growing prefix
+// of the shuffled rows (the sample doubles every round). Each tree's sample mean and the half width
+// of its confidence interval are stored with setScore. A tree is dropped as soon as its interval
+// lies entirely below the k-th highest lower bound, since it is then very unlikely to be in the top k.
+// The half width uses the finite population correction, so it shrinks to 0 once the sample is the
+// whole input. The race is still approximate: an early round can drop a tree that exact scoring
+// would keep, with a probability set by the confidence z.
+// The sums of squares are taken around each tree's first output, so a large offset common to all
+// outputs does not cancel away the variance.
+// The trees that survive are scored exactly, so the printed scores match the exact mode.
+vector<LinkedBinaryTree> raceTopK(const vector<LinkedBinaryTree>& trees, const Dataset& data,
+                                  size_t k, double z, uint64_t seed) {
+    if (k == 0)
+        return {};
+    size_t N = data.rows();
+
+    // Shuffle the rows once so every prefix is a uniform random sample.
+    vector<size_t> perm(N);
+    for (size_t i = 0; i < N; i++)
+        perm[i] = i;
+    mt19937_64 rng(seed);
+    shuffle(perm.begin(), perm.end(), rng);
+    Dataset sample;
+    sample.names = data.names;
+    sample.columns.resize(data.columns.size());
+    for (size_t c = 0; c < data.columns.size(); c++)
+        for (size_t i : perm)
+            sample.columns[c].push_back(data.columns[c][i]);
+    if (!data.weights.empty())
+        for (size_t i : perm)
+            sample.weights.push_back(data.weights[i]);
+    double total = data.count(); // rows the dataset stands for
+
+    vector<LinkedBinaryTree> racers = trees;
+    vector<CompiledExpression> code;
+    for (auto& t : racers)
+        code.emplace_back(t);
+    vector<double> sum(racers.size(), 0), sumSq(racers.size(), 0); // of the outputs minus shift
+    vector<double> shift(racers.size(), 0);
+    vector<size_t> alive;
+    for (size_t i = 0; i < racers.size(); i++)
+        alive.push_back(i);
+
+    size_t seen = 0, evaluations = 0, rounds = 0;
+    double seenCount = 0; // rows the sample stands for
+    vector<double> out(CompiledExpression::BLOCK);
+    while (alive.size() > k && seen < N) {
+        size_t next = min(N, max<size_t>(64, seen * 2));
+        for (size_t r = seen; r < next; r++)
+            seenCount += sample.weight(r);
+        rounds++;
+        for (size_t i : alive) {
+            for (size_t start = seen; start < next; start += CompiledExpression::BLOCK) {
+                size_t m = min(CompiledExpression::BLOCK, next - start);
+                code[i].evaluateRange(sample, start, m, out.data());
+                if (start == 0 && isfinite(out[0]))
+                    shift[i] = out[0];
+                for (size_t r = 0; r < m; r++) {
+                    double w = sample.weight(start + r);
+                    double d = out[r] - shift[i];
+                    sum[i] += w * d;
+                    sumSq[i] += w * d * d;
+                }
+            }
+            double offset = sum[i] / seenCount;
+            double mean = shift[i] + offset;
+            double variance = max(0.0, sumSq[i] / seenCount - offset * offset);
+            double fpc = (total > 1) ? (total - seenCount) / (total - 1) : 0;
+            racers[i].setScore(mean, z * sqrt(variance / seenCount * fpc));
+        }
+        evaluations += alive.size() * (next - seen);
+        seen = next;
+
+        // The k-th highest lower bound is the score a tree must be able to reach to stay in the race.
+        vector<double> lower;
+        for (size_t i : alive)
+            if (!isnan(racers[i].getScore()))
+                lower.push_back(racers[i].getScore() - racers[i].getScoreError());
+        if (lower.size() < k)
+            continue;
+        nth_element(lower.begin(), lower.begin() + (k - 1), lower.end(), greater<double>());
+        double threshold = lower[k - 1];
+        vector<size_t> survivors;
+        for (size_t i : alive) {
+            double score = racers[i].getScore();
+            if (!isnan(score) && score + racers[i].getScoreError() >= threshold)
+                survivors.push_back(i);
+        }
+        alive.swap(survivors);
+    }
+    cerr << "Raced " << trees.size() << " trees for " << rounds << " rounds on up to " << seen
+         << " rows: " << alive.size() << " survived, " << evaluations << " row evaluations ("
+         << 100.0 * evaluations / max<size_t>(1, trees.size() * N) << "% of exact)" << endl;
+
+    // Score the survivors exactly and keep the best k of them.
+    vector<LinkedBinaryTree> survivors;
+    for (size_t i : alive) {
+        racers[i].setScore(code[i].score(data));
+        if (!isnan(racers[i].getScore()))
+            survivors.push_back(racers[i]);
+    }
+    sort(survivors.begin(), survivors.end());
+    if (survivors.size() > k)
+        survivors.erase(survivors.begin(), survivors.end() - k);
+    return survivors;
+}
+
+//*****************************************************
+// Score Statistics
+
+//
+// A mergeable sketch of a distribution that answers quantile queries with a relative error of at
+// most ALPHA (the DDSketch design). Values are counted in logarithmic buckets whose bounds grow by
+// a factor of gamma = (1 + ALPHA) / (1 - ALPHA); merging two sketches just adds their buckets, so
+// the result does not depend on how the values were split between workers.
+class QuantileSketch {
 public:
-    LinkedBinaryTree();
-    // Big Three: copy constructor, assignment operator, and destructor.
-    LinkedBinaryTree(const LinkedBinaryTree &other);
-    LinkedBinaryTree& operator=(const LinkedBinaryTree &other);
-    ~LinkedBinaryTree();
-
-    int size() const;
-    bool empty() const;
-    Position root() const;
-    PositionList positions() const;
-    void addRoot();
-    void expandExternal(const Position &p);
-    Position removeAboveExternal(const Position &p);
-
-    // New methods for expression tree functionality
-    void printExpression() const;        // prints the expresion tree in infix form with parentheses
-    double evaluateExpression(double a, double b) const; // evaluates the expresion tree given values for a and b
-    double getScore() const;               // returns the tree's score
-    void setScore(double s);               // sets the tree's score
-    bool operator<(const LinkedBinaryTree &other) const; // overload operator for comparing trees by score
-
-    // Friend declaration so that createExpressionTree can access private members.
-    friend LinkedBinaryTree createExpressionTree(const string& postfix);
-
-protected:
-    void preorder(Node* v, PositionList &pl) const; // recursive helper for traversal
-    void printExpression(Node* v) const;            // recursive helper to print the expresion tree
-    double evaluateExpression(Node* v, double a, double b) const; // recursive helper to evaluate the tree
+    void add(double x, double w);              // counts a finite value with weight w
+    void merge(const QuantileSketch& other);   // adds all values counted by other
+    double quantile(double q) const;           // value at quantile q in [0, 1] (NaN if empty)
+private:
+    static constexpr double ALPHA = 0.01;
+    static double gamma() { return (1 + ALPHA) / (1 - ALPHA); }
+    static int bucket(double magnitude) { return (int)ceil(log(magnitude) / log(gamma())); }
+    static double bucketValue(int i) { return 2 * pow(gamma(), i) / (gamma() + 1); }
+
+    map<int, double> positive; // weight in each bucket of positive values
+    map<int, double> negative; // weight in each bucket of negative values, by magnitude
+    double zeros = 0;          // weight of values too small to bucket
+    double total = 0;
+};
+
+void QuantileSketch::add(double x, double w) {
+    if (fabs(x) < numeric_limits<double>::min())
+        zeros += w;
+    else if (x > 0)
+        positive[bucket(x)] += w;
+    else
+        negative[bucket(-x)] += w;
+    total += w;
+}
+
+void QuantileSketch::merge(const QuantileSketch& other) {
+    for (auto& b : other.positive)
+        positive[b.first] += b.second;
+    for (auto& b : other.negative)
+        negative[b.first] += b.second;
+    zeros += other.zeros;
+    total += other.total;
+}
+
+// Walks the buckets from the most negative value up to the one holding the requested rank.
+double QuantileSketch::quantile(double q) const {
+    if (total <= 0)
+        return numeric_limits<double>::quiet_NaN();
+    double rank = q * total, seen = 0;
+    for (auto it = negative.rbegin(); it != negative.rend(); ++it) {
+        seen += it->second;
+        if (seen >= rank)
+            return -bucketValue(it->first);
+    }
+    seen += zeros;
+    if (seen >= rank)
+        return 0;
+    for (auto& b : positive) {
+        seen += b.second;
+        if (seen >= rank)
+            return bucketValue(b.first);
+    }
+    return positive.empty() ? 0 : bucketValue(positive.rbegin()->first);
+}
+
+//
+// Statistics of one tree's outputs, collected in a single pass without storing them.
+// The mean is the plain sum divided by the row count, so it is the same number as the normal score.
+// The variance (Welford's update) and the quantiles cover the finite outputs, min and max all but
+// NaN, and NaN and infinite outputs are also counted. Two ScoreStats over different rows merge
+// into the statistics of all of them.
+struct ScoreStats {
+    double count = 0;  // rows seen (weighted after --dedup)
+    double sum = 0;    // plain sum of all outputs
+    double finite = 0; // weight of the finite outputs
+    double mean = 0;   // running mean of the finite outputs
+    double m2 = 0;     // running sum of squared deviations from that mean
+    double min = numeric_limits<double>::infinity();
+    double max = -numeric_limits<double>::infinity();
+    double nanCount = 0;
+    double infCount = 0;
+    QuantileSketch sketch;
+
+    void add(double x, double w);
+    void merge(const ScoreStats& other);
+    double get(const string& stat) const; // one statistic by name (see statNames)
+};
+
+// The statistics --rank-by accepts, in the order they are printed.
+const vector<string> statNames = {"mean", "variance", "stddev", "min", "max", "median", "p99", "nan", "inf"};
+
+void ScoreStats::add(double x, double w) {
+    count += w;
+    sum += w == 1 ? x : w * x;
+    if (isnan(x)) {
+        nanCount += w;
+        return;
+    }
+    min = std::min(min, x);
+    max = std::max(max, x);
+    if (isinf(x)) {
+        infCount += w;
+        return;
+    }
+    finite += w;
+    double delta = x - mean;
+    mean += delta * w / finite;
+    m2 += w * delta * (x - mean);
+    sketch.add(x, w);
+}
+
+// Combines the moments with Chan et al.'s formula for merging partial variances.
+void ScoreStats::merge(const ScoreStats& other) {
+    if (other.finite > 0) {
+        double n = finite + other.finite;
+        double delta = other.mean - mean;
+        mean += delta * other.finite / n;
+        m2 += other.m2 + delta * delta * finite * other.finite / n;
+        finite = n;
+    }
+    count += other.count;
+    sum += other.sum;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+    nanCount += other.nanCount;
+    infCount += other.infCount;
+    sketch.merge(other.sketch);
+}
+
+double ScoreStats::get(const string& stat) const {
+    if (stat == "mean") return sum / count;
+    if (stat == "variance") return finite > 0 ? m2 / finite : numeric_limits<double>::quiet_NaN();
+    if (stat == "stddev") return sqrt(get("variance"));
+    if (stat == "min") return min;
+    if (stat == "max") return max;
+    // The sketch's estimates are clamped to the exact range, which also makes them exact for constants.
+    if (stat == "median") return std::max(min, std::min(max, sketch.quantile(0.5)));
+    if (stat == "p99") return std::max(min, std::min(max, sketch.quantile(0.99)));
+    if (stat == "nan") return nanCount;
+    if (stat == "inf") return infCount;
+    return numeric_limits<double>::quiet_NaN();
+}
+
+// Collects the statistics of one program over rows from..to-1.
+ScoreStats collectStats(const CompiledExpression& code, const Dataset& data, size_t from, size_t to) {
+    ScoreStats stats;
+    double out[CompiledExpression::BLOCK];
+    for (size_t start = from; start < to; start += CompiledExpression::BLOCK) {
+        size_t m = min(CompiledExpression::BLOCK, to - start);
+        code.evaluateRange(data, start, m, out);
+        for (size_t i = 0; i < m; i++)
+            stats.add(out[i], data.weight(start + i));
+    }
+    return stats;
+}
+
+//
+// Collects the statistics of every tree, ranks the trees by the chosen statistic (lowest first, like
+// the score) and writes each line with all statistics appended. The work is spread over the
+// threads by tree; when there are fewer trees than threads each tree's rows are also split into
+// shards whose statistics are merged in order (the mean can then differ in the last bits).
+int runStats(vector<LinkedBinaryTree>& trees, const Dataset& data, const string& rankBy, int threads, int fd) {
+    size_t shards = max<size_t>(1, min<size_t>((threads + trees.size() - 1) / max<size_t>(1, trees.size()),
+                                               data.rows() / CompiledExpression::BLOCK));
+    vector<ScoreStats> partial(trees.size() * shards);
+    atomic<size_t> nextItem(0);
+    runParallel(threads, [&](size_t) {
+        for (size_t item; (item = nextItem.fetch_add(1)) < partial.size(); ) {
+            size_t t = item / shards, s = item % shards;
+            partial[item] = collectStats(CompiledExpression(trees[t]), data,
+                                         data.rows() * s / shards, data.rows() * (s + 1) / shards);
+        }
+    });
+
+    vector<ScoreStats> stats(trees.size());
+    for (size_t t = 0; t < trees.size(); t++) {
+        stats[t] = partial[t * shards];
+        for (size_t s = 1; s < shards; s++)
+            stats[t].merge(partial[t * shards + s]);
+        trees[t].setScore(stats[t].get(rankBy));
+    }
+    vector<size_t> order(trees.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    stable_sort(order.begin(), order.end(), [&](size_t x, size_t y) { return trees[x] < trees[y]; });
+
+    string out;
+    for (size_t i : order) {
+        appendResultLine(out, trees[i]);
+        out.pop_back(); // the newline
+        for (auto& name : statNames) {
+            out += ' ';
+            out += name;
+            out += ' ';
+            appendScore(out, stats[i].get(name));
+        }
+        out += '\n';
+        if (out.size() >= 1 << 16) {
+            if (!writeAll(fd, out))
+                return 1;
+            out.clear();
+        }
+    }
+    return writeAll(fd, out) ? 0 : 1;
+}
+
+//*****************************************************
+// Pareto Ranking
+
+//
+// Ranks trees on two objectives at once, a higher score and a smaller size, with the Pareto fronts
+// and crowding distances of pareto.h.
+
+// Prints the first maxFronts Pareto fronts of the scored trees, front 1 first. Each front is listed
+// from its smallest tree up, and each line gets the tree's size, front and crowding distance.
+int runPareto(const vector<LinkedBinaryTree>& trees, size_t maxFronts, int fd) {
+    if (trees.size() > UINT32_MAX) {
+        cerr << "Too many trees to rank" << endl;
+        return 1;
+    }
+    vector<ParetoRecord> recs(trees.size());
+    for (size_t i = 0; i < trees.size(); i++) {
+        double s = trees[i].getScore();
+        recs[i] = {isnan(s) ? -numeric_limits<double>::infinity() : s, uint32_t(trees[i].size()), uint32_t(i)};
+    }
+    vector<uint32_t> front = paretoFronts(recs);
 
-private:
-    Node* _root;   // pointer to the root node of the tree
-    int n;         // number of nodes in the tree
-    double score;  // score computed from evaluating the tree (average)
-
-    //CHATGPT
-    // Helper functions for deep copy and destruction of nodes.
-    Node* clone(Node* v) const;  // recursively clone the tree (CHATGPT was used here to help implement deep copy using recursion)
-    void destroy(Node* v);       // recursively delete nodes in the tree
-    int countNodes(Node* v) const; // count number of nodes in a subtree
-};
+    // Group the records by front, keeping the order of decreasing score within each.
+    size_t fronts = recs.empty() ? 0 : *max_element(front.begin(), front.end()) + 1;
+    vector<size_t> start(fronts + 1, 0);
+    for (uint32_t f : front)
+        start[f + 1]++;
+    for (size_t f = 0; f < fronts; f++)
+        start[f + 1] += start[f];
+    vector<ParetoRecord> grouped(recs.size());
+    vector<size_t> next(start.begin(), start.end() - 1);
+    for (size_t i = 0; i < recs.size(); i++)
+        grouped[next[front[i]]++] = recs[i];
+    recs.clear();
+    recs.shrink_to_fit();
+
+    string out;
+    for (size_t f = 0; f < min(fronts, maxFronts); f++) {
+        vector<ParetoRecord> members(grouped.begin() + start[f], grouped.begin() + start[f + 1]);
+        vector<double> dist = crowdingDistances(members);
+        for (size_t k = members.size(); k-- > 0; ) {
+            appendResultLine(out, trees[members[k].index]);
+            out.pop_back(); // the newline
+            out += " Size " + to_string(members[k].size) + " Front " + to_string(f + 1) + " Crowding ";
+            appendScore(out, dist[k]);
+            out += '\n';
+            if (out.size() >= 1 << 16) {
+                if (!writeAll(fd, out))
+                    return 1;
+                out.clear();
+            }
+        }
+    }
+    return writeAll(fd, out) ? 0 : 1;
+}
 
 //*****************************************************
-// Constructor & Basic Methods
+// Constant Tuning
 
-LinkedBinaryTree::LinkedBinaryTree() : _root(nullptr), n(0), score(0.0) {}
+//
+// Raises a tree's score by gradient ascent on its literals. Each step moves the literals along the
+// gradient by a step length that doubles after a step that raises the score and halves (without
+// moving) after one that does not. The literals are written back with the fewest digits that read
+// back exactly, so the printed tree scores exactly what the tuning found.
+void tuneConstants(LinkedBinaryTree& t, const Dataset& data, int iterations) {
+    CompiledExpression code(t);
+    vector<double> c = code.constants(), gradient;
+    double best = code.scoreGradient(data, gradient);
+    double step = 1;
+    for (int it = 0; it < iterations && isfinite(best) && step > 1e-12; it++) {
+        double norm = 0;
+        for (double g : gradient)
+            norm += g * g;
+        norm = sqrt(norm);
+        if (!(norm > 0) || !isfinite(norm))
+            break;
+        vector<double> trial(c.size());
+        for (size_t k = 0; k < c.size(); k++) {
+            trial[k] = c[k] + step * gradient[k] / norm;
+            if (fpclassify(trial[k]) == FP_SUBNORMAL) // stod rejects these
+                trial[k] = 0;
+        }
+        code.setConstants(trial);
+        vector<double> trialGradient;
+        double s = code.scoreGradient(data, trialGradient);
+        if (s > best) {
+            best = s;
+            c = trial;
+            gradient = trialGradient;
+            step *= 2;
+        } else {
+            step /= 2;
+        }
+    }
+    t.setConstants(c);
+    t.setScore(CompiledExpression(t).score(data));
+}
 
-// Returns the total number of nodes in the tree
-int LinkedBinaryTree::size() const { return n; }
+// Tunes the literals of every tree, spreading the trees over the threads.
+void tuneTrees(vector<LinkedBinaryTree>& trees, const Dataset& data, int iterations, int threads) {
+    auto started = chrono::steady_clock::now();
+    atomic<size_t> next(0);
+    runParallel(threads, [&](size_t) {
+        for (size_t i; (i = next.fetch_add(1)) < trees.size(); )
+            tuneConstants(trees[i], data, iterations);
+    });
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    cerr << "Tuned the literals of " << trees.size() << " trees in " << seconds << " s" << endl;
+}
 
-// Checks if tree is empty
-bool LinkedBinaryTree::empty() const { return size() == 0; }
+//*****************************************************
+// Numeric Precision
 
-// Returns a Position representing the root
-LinkedBinaryTree::Position LinkedBinaryTree::root() const { return Position(_root); }
+//
+// With --precision float, every tree is evaluated and averaged in single precision, which halves
+// the memory traffic and doubles the SIMD width; long double evaluates in extended precision to
+// check double results. The literals are converted from their double values. Since a screening
+// run is only useful if it ranks trees like the double evaluation, the scores are also computed
+// in double and the two rankings are compared on standard error.
 
-// Adds a new root node to an empty tree
-void LinkedBinaryTree::addRoot() {
-    _root = new Node;
-    n = 1;
+// Returns each tree's rank (0 for the lowest score, NaN last, ties by position).
+static vector<size_t> ranks(const vector<double>& scores) {
+    vector<size_t> order(scores.size()), rank(scores.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    stable_sort(order.begin(), order.end(), [&](size_t x, size_t y) {
+        if (isnan(scores[x]) || isnan(scores[y]))
+            return !isnan(scores[x]) && isnan(scores[y]);
+        return scores[x] < scores[y];
+    });
+    for (size_t i = 0; i < order.size(); i++)
+        rank[order[i]] = i;
+    return rank;
 }
 
-// Expands an external node (leaf) by adding two children nodes
-void LinkedBinaryTree::expandExternal(const Position &p) {
-    Node* v = p.v;
-    v->left = new Node;
-    v->left->par = v;
-    v->right = new Node;
-    v->right->par = v;
-    n += 2;
+template <typename T>
+static void scoreAll(const vector<LinkedBinaryTree>& trees, const Dataset& data, vector<double>& scores, int threads) {
+    TypedColumns<T> columns(data);
+    atomic<size_t> next(0);
+    runParallel(threads, [&](size_t) {
+        for (size_t i; (i = next.fetch_add(1)) < trees.size(); )
+            scores[i] = double(CompiledExpression(trees[i]).scoreAs(columns));
+    });
 }
 
-// Removes an external node and its parent, replacing them with the sibling node
-LinkedBinaryTree::Position LinkedBinaryTree::removeAboveExternal(const Position &p) {
-    Node* w = p.v;
-    Node* v = w->par;
-    Node* sib = (w == v->left ? v->right : v->left);
-    if (v == _root) {
-        _root = sib;
-        sib->par = nullptr;
-    } else {
-        Node* gpar = v->par;
-        if (v == gpar->left)
-            gpar->left = sib;
-        else
-            gpar->right = sib;
-        sib->par = gpar;
+// Scores the trees in the given precision ("float" or "long-double") and reports how far the
+// scores and ranking are from those of double precision.
+void scoreInPrecision(vector<LinkedBinaryTree>& trees, const Dataset& data, const string& precision, int threads) {
+    vector<double> scores(trees.size()), reference(trees.size());
+    auto started = chrono::steady_clock::now();
+    if (precision == "float")
+        scoreAll<float>(trees, data, scores, threads);
+    else
+        scoreAll<long double>(trees, data, scores, threads);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    started = chrono::steady_clock::now();
+    scoreAll<double>(trees, data, reference, threads);
+    double referenceSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    for (size_t i = 0; i < trees.size(); i++)
+        trees[i].setScore(scores[i]);
+
+    // Compare: relative score error, Spearman correlation of the ranks, and overlap of the top 10.
+    double maxError = 0;
+    size_t nanMismatches = 0;
+    for (size_t i = 0; i < trees.size(); i++) {
+        if (isnan(scores[i]) != isnan(reference[i])) {
+            nanMismatches++;
+        } else if (scores[i] != reference[i]) {
+            double error = fabs(scores[i] - reference[i]) / max(fabs(reference[i]), numeric_limits<double>::min());
+            if (!isnan(error))
+                maxError = max(maxError, error);
+        }
     }
-    delete w;
-    delete v;
-    n -= 2;
-    return Position(sib);
+    vector<size_t> r = ranks(scores), ref = ranks(reference);
+    double d2 = 0;
+    size_t moved = 0, topBoth = 0, n = trees.size(), top = min<size_t>(10, n);
+    for (size_t i = 0; i < n; i++) {
+        double d = double(r[i]) - double(ref[i]);
+        d2 += d * d;
+        moved += r[i] != ref[i];
+        topBoth += r[i] >= n - top && ref[i] >= n - top;
+    }
+    double spearman = n > 1 ? 1 - 6 * d2 / (double(n) * (double(n) * n - 1)) : 1;
+    cerr << precision << " vs double: " << seconds << " s vs " << referenceSeconds << " s, max relative score error "
+         << maxError << ", " << nanMismatches << " NaN mismatches, " << moved << " of " << n
+         << " trees ranked differently, Spearman " << spearman << ", top " << top << " overlap " << topBoth << endl;
 }
 
-// Returns a list of all positions in the tree using preorder traversal
-LinkedBinaryTree::PositionList LinkedBinaryTree::positions() const {
-    PositionList pl;
-    preorder(_root, pl);
-    return PositionList(pl);
+//*****************************************************
+// Multi-Process Scoring
+
+//
+// The coordinator forks worker processes that score one shard each and report through a shared
+// memory segment mapped before the fork. A worker that crashes only loses its own shard, which the
+// coordinator runs once more in a fresh process before giving up.
+//  - Sharding by expressions: worker w scores trees w, w + N, w + 2N, ... on all rows and stores
+//    their scores. Each score is computed exactly as in one process, so the output is identical.
+//  - Sharding by rows: worker w reads only the w-th of N contiguous ranges of rows of input.txt
+//    (so no process holds the whole input). For every tree it evaluates its rows, then waits for
+//    worker w - 1 to publish the sum of all rows before its range, adds its own outputs to that
+//    in row order and publishes the result. The last worker's sum is thus built by the very same
+//    additions as in one process, and the output is identical. Only the additions wait on each
+//    other; evaluating the next tree overlaps with the workers further down the chain.
+
+// Maps memory that stays shared with the processes forked afterwards.
+static double* sharedDoubles(size_t count) {
+    void* p = mmap(nullptr, max<size_t>(1, count) * sizeof(double), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return static_cast<double*>(p);
 }
 
-// Helper: Preorder traversal to collect positions
-void LinkedBinaryTree::preorder(Node* v, PositionList &pl) const {
-    if (v == nullptr) return;
-    pl.push_back(Position(v));
-    if (v->left != nullptr)
-        preorder(v->left, pl);
-    if (v->right != nullptr)
-        preorder(v->right, pl);
+// Maps count counters, all zero, that stay shared with the processes forked afterwards.
+static atomic<size_t>* sharedCounters(size_t count) {
+    static_assert(atomic<size_t>::is_always_lock_free, "shared counters must be lock free");
+    void* p = mmap(nullptr, max<size_t>(1, count) * sizeof(atomic<size_t>), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    atomic<size_t>* counters = static_cast<atomic<size_t>*>(p);
+    for (size_t i = 0; i < count; i++)
+        new (&counters[i]) atomic<size_t>(0);
+    return counters;
 }
 
-//*****************************************************
-// New Methods for Expression Trees
+// Runs work(w) for every shard in its own process and waits for them, retrying failed shards once.
+static bool runWorkers(int procs, const function<void(int)>& work) {
+    vector<pid_t> pids(procs);
+    vector<int> attempts(procs, 0);
+    auto spawn = [&](int w) {
+        attempts[w]++;
+        pids[w] = fork();
+        if (pids[w] == 0) {
+            work(w);
+            _exit(0); // skip the coordinator's atexit handlers and stdio buffers
+        }
+        if (pids[w] < 0) {
+            perror("fork");
+            exit(1);
+        }
+    };
+    for (int w = 0; w < procs; w++)
+        spawn(w);
+    int running = procs;
+    while (running > 0) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            perror("wait");
+            return false;
+        }
+        int w = find(pids.begin(), pids.end(), pid) - pids.begin();
+        if (w == procs) continue;
+        running--;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+            continue;
+        cerr << "Worker " << w << " failed (status " << status << ")" << endl;
+        if (attempts[w] > 1)
+            return false;
+        spawn(w);
+        running++;
+    }
+    return true;
+}
 
-// Recursively prints the expresion tree in infix notation with proper parenthesis.
-// If the node is a leaf, its value is printed directly. For non-leaf nodes,
-// if the node represents the unary operator "abs", it prints it accordingly.
-void LinkedBinaryTree::printExpression(Node* v) const {
-    if (v == nullptr)
+// Scores the trees in procs worker processes, sharding by expressions or (with byRows) by input rows.
+// data must hold the input when sharding by expressions; when sharding by rows the workers read
+// their own rows of filename.
+void scoreInProcesses(vector<LinkedBinaryTree>& trees, const Dataset& data, const string& filename,
+                      int procs, bool byRows) {
+    size_t T = trees.size();
+    if (!byRows) {
+        double* scores = sharedDoubles(T);
+        bool ok = runWorkers(procs, [&](int w) {
+            for (size_t t = w; t < T; t += procs)
+                scores[t] = CompiledExpression(trees[t]).score(data);
+        });
+        if (!ok) {
+            cerr << "Scoring failed" << endl;
+            exit(1);
+        }
+        for (size_t t = 0; t < T; t++)
+            trees[t].setScore(scores[t]);
+        munmap(scores, max<size_t>(1, T) * sizeof(double));
         return;
-    // If it's a leaf node, simply print its element.
-    if (v->left == nullptr && v->right == nullptr) {
-        cout << v->elt;
-    } else {
-        // For the unary operator "abs"
-        if (v->elt == "abs") {
-            cout << "abs(";
-            printExpression(v->left);
-            cout << ")";
-        } else {
-            // For binary operators, print with parentheses: (left operator right)
-            cout << "(";
-            printExpression(v->left);
-            cout << v->elt; // print the operator
-            printExpression(v->right);
-            cout << ")";
+    }
+
+    // One row of running sums per worker, followed by each worker's row count. published[w] is
+    // the number of trees worker w has summed (a retried worker carries on from there), and
+    // published[procs] is set when the run fails, to stop workers waiting on a dead neighbour.
+    double* partial = sharedDoubles(procs * T + procs);
+    atomic<size_t>* published = sharedCounters(procs + 1);
+    bool ok = runWorkers(procs, [&](int w) {
+        Dataset shard = readDataset(filename, w, procs);
+        vector<double> out(shard.rows());
+        for (size_t t = published[w].load(); t < T; t++) {
+            CompiledExpression code(trees[t]);
+            for (size_t start = 0; start < shard.rows(); start += CompiledExpression::BLOCK)
+                code.evaluateRange(shard, start, min(CompiledExpression::BLOCK, shard.rows() - start), &out[start]);
+            while (w > 0 && published[w - 1].load(memory_order_acquire) <= t) {
+                if (published[procs].load())
+                    _exit(1);
+                this_thread::yield();
+            }
+            double sum = w > 0 ? partial[(w - 1) * T + t] : 0;
+            addOutputs(shard, 0, shard.rows(), out.data(), sum);
+            partial[w * T + t] = sum;
+            published[w].store(t + 1, memory_order_release);
         }
+        partial[procs * T + w] = shard.count();
+    });
+    if (!ok) {
+        published[procs].store(1);
+        cerr << "Scoring failed" << endl;
+        exit(1);
     }
+    double rows = 0;
+    for (int w = 0; w < procs; w++)
+        rows += partial[procs * T + w];
+    for (size_t t = 0; t < T; t++)
+        trees[t].setScore(partial[(procs - 1) * T + t] / rows);
+    munmap(partial, (procs * T + procs) * sizeof(double));
+    munmap(published, (procs + 1) * sizeof(atomic<size_t>));
+}
+
+//*****************************************************
+// Genetic Programming
+
+//
+// Evolves a population of trees toward higher scores. Every generation keeps the best tree and
+// fills the rest of the population with children of parents picked by tournament (the best of a
+// few random trees): a child is either a crossover, where a random subtree of one parent is cut
+// back to a leaf and regrown as a copy of a random subtree of the other, or a mutation of one
+// parent (a subtree regrown at random, a leaf removed together with its parent, or one node
+// changed). All edits go through addRoot, expandExternal, removeAboveExternal and pruneBelow.
+// The population is held as PersistentTrees, so the copies made of a tree (the best one kept,
+// and a parent standing in for an oversized child) share its nodes; a child is made editable
+// with toTree and stored back once built.
+// The children of a generation are scored in parallel, but all random choices are made by one
+// generator in a fixed order, so a seed always gives the same result whatever the thread count.
+
+class Evolver {
+public:
+    Evolver(const Dataset& data, uint64_t seed) : data(data), rng(seed) {}
+    vector<LinkedBinaryTree> run(const vector<LinkedBinaryTree>& seeds, size_t size, int generations,
+                                 int tournament, int threads);
+
+    static const int MAX_NODES = 64; // children larger than this are replaced by their parent
+private:
+    typedef LinkedBinaryTree::Position Position;
+    size_t uniform(size_t n) { return uniform_int_distribution<size_t>(0, n - 1)(rng); }
+    static double fitness(const PersistentTree& t); // score, with NaN and infinities worst
+    void randomLeaf(Position p);
+    void grow(LinkedBinaryTree& t, Position p, int depth);
+    void graft(LinkedBinaryTree& t, Position p, const PersistentTree::Ref& from);
+    Position randomPosition(const LinkedBinaryTree& t);
+    const PersistentTree& select(const vector<PersistentTree>& population, int tournament);
+    LinkedBinaryTree crossover(const PersistentTree& a, const PersistentTree& b);
+    LinkedBinaryTree mutate(const PersistentTree& a);
+    void score(vector<PersistentTree>& trees, size_t from, int threads);
+
+    const Dataset& data;
+    mt19937_64 rng;
+};
+
+// An infinite score only says some row divided by zero, so it ranks with NaN below every number.
+double Evolver::fitness(const PersistentTree& t) {
+    return isfinite(t.getScore()) ? t.getScore() : -numeric_limits<double>::infinity();
 }
 
-void LinkedBinaryTree::printExpression() const {
-    printExpression(_root);
+// Makes the external node p a random variable or a literal with at most one decimal.
+void Evolver::randomLeaf(Position p) {
+    if (uniform(2) == 0) {
+        p.setElement(data.names[uniform(data.names.size())]);
+    } else {
+        char buf[32];
+        auto res = to_chars(buf, buf + sizeof(buf), (double(uniform(199)) - 99) / 10);
+        p.setElement(string(buf, res.ptr));
+    }
 }
 
-// Recursively evaluates the expresion tree using the given values for a and b.
-// If the node is a leaf, returns the value of the variable or numeric literal.
-// For operator nodes, recursively evalutes subtrees and applies the operator.
-// NOTE: For the operator ">", returns 1 if left > right else -1.
-double LinkedBinaryTree::evaluateExpression(Node* v, double a, double b) const {
-    if (v == nullptr) return 0;
-    // If it's a leaf, check if it's a variable or a number.
-    if (v->left == nullptr && v->right == nullptr) {
-        if (v->elt == "a")
-            return a;
-        else if (v->elt == "b")
-            return b;
-        else
-            return std::stod(v->elt);  // convert string to double
+// Grows a random subtree of at most the given depth at the external node p.
+void Evolver::grow(LinkedBinaryTree& t, Position p, int depth) {
+    static const char* ops[] = {"+", "-", "*", "/", ">", "abs"};
+    if (depth <= 1 || uniform(3) == 0) {
+        randomLeaf(p);
+        return;
+    }
+    p.setElement(ops[uniform(6)]);
+    if (*p == "abs") {
+        t.expandExternalUnary(p);
     } else {
-        // For the unary operator "abs"
-        if (v->elt == "abs") {
-            double val = evaluateExpression(v->left, a, b);
-            return (val < 0) ? -val : val;
-        }
-        // For binary operators, evaluate both left and right subtrees.
-        double leftVal = evaluateExpression(v->left, a, b);
-        double rightVal = evaluateExpression(v->right, a, b);
-        if (v->elt == "+")
-            return leftVal + rightVal;
-        else if (v->elt == "-")
-            return leftVal - rightVal;
-        else if (v->elt == "*")
-            return leftVal * rightVal;
-        else if (v->elt == "/")
-            return leftVal / rightVal;
-        else if (v->elt == ">")
-            return (leftVal > rightVal) ? 1 : -1;
-        else
-            return 0; // Should not occur (unexpected operator)
+        t.expandExternal(p);
+        grow(t, p.right(), depth - 1);
+    }
+    grow(t, p.left(), depth - 1);
+}
+
+// Copies the subtree from (of another tree) onto the external node p.
+void Evolver::graft(LinkedBinaryTree& t, Position p, const PersistentTree::Ref& from) {
+    p.setElement(from->elt);
+    if (from->left == nullptr && from->right == nullptr)
+        return;
+    if (from->elt == "abs") {
+        t.expandExternalUnary(p);
+    } else {
+        t.expandExternal(p);
+        graft(t, p.right(), from->right);
     }
+    graft(t, p.left(), from->left);
 }
 
-double LinkedBinaryTree::evaluateExpression(double a, double b) const {
-    return evaluateExpression(_root, a, b);
+LinkedBinaryTree::Position Evolver::randomPosition(const LinkedBinaryTree& t) {
+    auto all = t.positions();
+    auto it = all.begin();
+    advance(it, uniform(all.size()));
+    return *it;
 }
 
-// Returns the average score stored in the tree
-double LinkedBinaryTree::getScore() const {
-    return score;
+const PersistentTree& Evolver::select(const vector<PersistentTree>& population, int tournament) {
+    size_t best = uniform(population.size());
+    for (int i = 1; i < tournament; i++) {
+        size_t other = uniform(population.size());
+        if (fitness(population[other]) > fitness(population[best]))
+            best = other;
+    }
+    return population[best];
 }
 
-// Sets the tree's score value
-void LinkedBinaryTree::setScore(double s) {
-    score = s;
+LinkedBinaryTree Evolver::crossover(const PersistentTree& a, const PersistentTree& b) {
+    LinkedBinaryTree child = a.toTree();
+    Position p = randomPosition(child);
+    child.pruneBelow(p);
+    graft(child, p, b.subtree(uniform(b.size())));
+    return child;
 }
 
-// Overload the less-than operator to compare trees by score.
-// This is useful for sorting trees.
-bool LinkedBinaryTree::operator<(const LinkedBinaryTree &other) const {
-    return this->score < other.score;
+LinkedBinaryTree Evolver::mutate(const PersistentTree& a) {
+    static const char* binary[] = {"+", "-", "*", "/", ">"};
+    LinkedBinaryTree child = a.toTree();
+    Position p = randomPosition(child);
+    switch (uniform(3)) {
+    case 0: // regrow a subtree
+        child.pruneBelow(p);
+        grow(child, p, 4);
+        break;
+    case 1: // remove a leaf and its parent, when the parent has another child to take its place
+        if (p.isExternal() && !p.isRoot() && *p.parent() != "abs")
+            child.removeAboveExternal(p);
+        break;
+    default: // change one node, keeping its number of children
+        if (p.isExternal())
+            randomLeaf(p);
+        else if (*p != "abs")
+            p.setElement(binary[uniform(5)]);
+        break;
+    }
+    return child;
 }
 
-//*****************************************************
-// Helper Functions for Deep Copy and Destruction
-
-// Recursively clones the subtree rooted at v and returns a pointer to the new clone.
-// CHATGPT was used here to design this recursive clone method for deep copying.
-LinkedBinaryTree::Node* LinkedBinaryTree::clone(LinkedBinaryTree::Node* v) const {
-    if (v == nullptr)
-        return nullptr;
-    LinkedBinaryTree::Node* newNode = new LinkedBinaryTree::Node;
-    newNode->elt = v->elt;
-    newNode->left = clone(v->left);
-    if(newNode->left != nullptr)
-        newNode->left->par = newNode;
-    newNode->right = clone(v->right);
-    if(newNode->right != nullptr)
-        newNode->right->par = newNode;
-    return newNode;
-}
-
-// Recursively destroys (deletes) the subtree rooted at v to free memory.
-void LinkedBinaryTree::destroy(Node* v) {
-    if (v != nullptr) {
-        destroy(v->left);
-        destroy(v->right);
-        delete v;
-    }
-}
-
-// Recursively counts the nodes in the subtree rooted at v.
-int LinkedBinaryTree::countNodes(Node* v) const {
-    if (v == nullptr)
-        return 0;
-    return 1 + countNodes(v->left) + countNodes(v->right);
+// Scores trees[from..] in parallel, each thread taking every threads-th tree.
+void Evolver::score(vector<PersistentTree>& trees, size_t from, int threads) {
+    runParallel(threads, [&](size_t w) {
+        for (size_t i = from + w; i < trees.size(); i += threads)
+            trees[i].setScore(CompiledExpression(trees[i].toTree()).score(data));
+    });
+}
+
+// Evolves the given trees (topped up with random ones to size trees) for the given number of
+// generations and returns the final population.
+vector<LinkedBinaryTree> Evolver::run(const vector<LinkedBinaryTree>& seeds, size_t size, int generations,
+                                      int tournament, int threads) {
+    string error;
+    vector<PersistentTree> population;
+    for (size_t i = 0; i < seeds.size() && i < size; i++)
+        population.emplace_back(seeds[i]);
+    while (population.size() < size) {
+        LinkedBinaryTree t;
+        t.addRoot();
+        grow(t, t.root(), 2 + uniform(4));
+        t.bindVariables(data.names, error);
+        population.emplace_back(t);
+    }
+    score(population, 0, threads);
+
+    auto started = chrono::steady_clock::now();
+    for (int g = 1; g <= generations; g++) {
+        vector<PersistentTree> next;
+        next.reserve(size);
+        next.push_back(*max_element(population.begin(), population.end(),
+            [](const PersistentTree& x, const PersistentTree& y) { return fitness(x) < fitness(y); }));
+        while (next.size() < size) {
+            const PersistentTree& a = select(population, tournament);
+            LinkedBinaryTree child = uniform(10) < 9 ? crossover(a, select(population, tournament)) : mutate(a);
+            if (child.size() > MAX_NODES) {
+                next.push_back(a);
+                continue;
+            }
+            child.bindVariables(data.names, error);
+            next.emplace_back(child);
+        }
+        score(next, 1, threads);
+        population.swap(next);
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    double best = fitness(*max_element(population.begin(), population.end(),
+        [](const PersistentTree& x, const PersistentTree& y) { return fitness(x) < fitness(y); }));
+    cerr << "Evolved " << generations << " generations of " << size << " trees in " << seconds << " s ("
+         << generations / seconds << " generations/sec), best score " << best << endl;
+    vector<LinkedBinaryTree> result;
+    for (auto& t : population)
+        result.push_back(t.toTree());
+    return result;
 }
 
 //*****************************************************
-// Big Three: Copy Constructor, Assignment Operator, Destructor
+// Checkpoints
+
+//
+// With --checkpoint FILE, a scoring run saves its progress every --checkpoint-every seconds: the
+// scores of the trees done so far and, for the tree being scored, the rows summed so far and their
+// sum. Trees are scored one after another, each summing its rows block by block, so a run resumed
+// with --resume adds up exactly the same numbers in the same order as one that was never stopped.
+// A save writes FILE.tmp, syncs it and renames it over FILE, so FILE is always a whole checkpoint.
+// SIGINT and SIGTERM save a checkpoint before the program exits.
+// File: "A4CP", version (4 bytes), run key (8), trees done (8), their scores (8 each),
+//       rows summed of the next tree (8), their sum (8).
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void requestStop(int) {
+    stopRequested = 1;
+}
+
+class Checkpoint {
+public:
+    // key identifies the run (input, expressions and scoring options); a saved checkpoint for
+    // another run is rejected when resuming.
+    Checkpoint(const string& path, double seconds, uint64_t key);
+    bool load();          // restores the saved progress; false if there is none
+    void tick();          // saves if one is due, or if a stop was requested (and then exits)
+    bool save();          // writes the progress now
+    void finishTree(double score); // records the score of the tree being scored
+
+    vector<double> scores; // scores of the trees done, in order
+    size_t row = 0;        // rows of the next tree already summed
+    double sum = 0;        // the sum of their outputs
+private:
+    string path;
+    double seconds;
+    uint64_t key;
+    chrono::steady_clock::time_point last;
+};
+
+static const char CHECKPOINT_MAGIC[4] = {'A', '4', 'C', 'P'};
+
+Checkpoint::Checkpoint(const string& path, double seconds, uint64_t key)
+    : path(path), seconds(seconds), key(key), last(chrono::steady_clock::now()) {
+    signal(SIGINT, requestStop);
+    signal(SIGTERM, requestStop);
+}
+
+bool Checkpoint::load() {
+    ifstream in(path, ios::binary);
+    if (!in)
+        return false;
+    string buf((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    uint32_t version;
+    uint64_t savedKey, done;
+    const size_t head = sizeof(CHECKPOINT_MAGIC) + sizeof(version) + sizeof(savedKey) + sizeof(done);
+    if (buf.size() < head || memcmp(buf.data(), CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0) {
+        cerr << path << " is not a checkpoint" << endl;
+        exit(1);
+    }
+    const char* p = buf.data() + sizeof(CHECKPOINT_MAGIC);
+    memcpy(&version, p, sizeof(version)); p += sizeof(version);
+    memcpy(&savedKey, p, sizeof(savedKey)); p += sizeof(savedKey);
+    memcpy(&done, p, sizeof(done)); p += sizeof(done);
+    if (version != 1 || buf.size() != head + done * sizeof(double) + sizeof(row) + sizeof(sum)) {
+        cerr << path << " is not a checkpoint" << endl;
+        exit(1);
+    }
+    if (savedKey != key) {
+        cerr << path << " was saved for other input, expressions or options" << endl;
+        exit(1);
+    }
+    scores.resize(done);
+    memcpy(scores.data(), p, done * sizeof(double)); p += done * sizeof(double);
+    memcpy(&row, p, sizeof(row)); p += sizeof(row);
+    memcpy(&sum, p, sizeof(sum));
+    return true;
+}
 
-// Copy constructor that makes a deep copy of the other tree.
-// CHATGPT was used here for guidance on recursive deep copying.
-LinkedBinaryTree::LinkedBinaryTree(const LinkedBinaryTree &other) : score(other.score) {
-    _root = clone(other._root);
-    n = countNodes(_root);
+bool Checkpoint::save() {
+    uint32_t version = 1;
+    uint64_t done = scores.size();
+    string buf(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    buf.append(reinterpret_cast<const char*>(&version), sizeof(version));
+    buf.append(reinterpret_cast<const char*>(&key), sizeof(key));
+    buf.append(reinterpret_cast<const char*>(&done), sizeof(done));
+    buf.append(reinterpret_cast<const char*>(scores.data()), done * sizeof(double));
+    buf.append(reinterpret_cast<const char*>(&row), sizeof(row));
+    buf.append(reinterpret_cast<const char*>(&sum), sizeof(sum));
+
+    string temp = path + ".tmp";
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    bool ok = fd >= 0 && writeAll(fd, buf) && fsync(fd) == 0;
+    if (fd >= 0)
+        close(fd);
+    ok = ok && rename(temp.c_str(), path.c_str()) == 0;
+    if (!ok)
+        cerr << "Could not write checkpoint " << path << endl;
+    last = chrono::steady_clock::now();
+    return ok;
 }
 
-// Assignment operator that frees existing memory and deep copies the other tree.
-LinkedBinaryTree& LinkedBinaryTree::operator=(const LinkedBinaryTree &other) {
-    if (this != &other) {
-        destroy(_root);
-        _root = clone(other._root);
-        n = countNodes(_root);
-        score = other.score;
+void Checkpoint::tick() {
+    if (stopRequested) {
+        bool ok = save();
+        cerr << "Stopped after " << scores.size() << " trees" << (ok ? "; continue with --resume" : "") << endl;
+        exit(1);
     }
-    return *this;
+    if (chrono::duration<double>(chrono::steady_clock::now() - last).count() >= seconds)
+        save();
 }
 
-// Destructor that cleans up all allocated nodes.
-LinkedBinaryTree::~LinkedBinaryTree() {
-    destroy(_root);
+void Checkpoint::finishTree(double score) {
+    scores.push_back(score);
+    row = 0;
+    sum = 0;
 }
 
 //*****************************************************
-// Helper Function: Create Expression Tree
+// Command-Line Options
 
-//
-// This function builds a binary expression tree from a postfix expression string.
-// It uses a stack to manage operands and operators. For each token:
-//  - If it's an operand, create a single node tree.
-//  - If it's an operator, pop one or two trees (depending on whether it is unary or binary)
-//    and make them subtrees of a new node containing the operator.
-// CHATGPT was used here to quickly devise the stack based algorithm.
-LinkedBinaryTree createExpressionTree(const string& postfix) {
-    stack<LinkedBinaryTree> s;
-    istringstream iss(postfix);
-    string token;
-    while (iss >> token) {
-        // Check if the token is an operator.
-        if (token == "abs" || token == "+" || token == "-" || token == "*" || token == "/" || token == ">") {
-            if (token == "abs") { // Unary operator
-                if (s.empty()) {
-                    cerr << "Invalid postfix expression: not enough operands for abs" << endl;
-                    exit(1);
-                }
-                LinkedBinaryTree operandTree = s.top();
-                s.pop();
-                LinkedBinaryTree T;
-                T.addRoot();
-                *T.root() = token;
-                // Attach the operand tree as the left child.
-                T._root->left = operandTree._root;
-                if (T._root->left != nullptr)
-                    T._root->left->par = T._root;
-                // For "abs", the right child is not used.
-                T._root->right = nullptr;
-                T.n = operandTree.n + 1;
-                // Invalidate the operand tree so its destructor won't delete nodes.
-                operandTree._root = nullptr;
-                operandTree.n = 0;
-                s.push(T);
-            } else { // Binary operator
-                if (s.size() < 2) {
-                    cerr << "Invalid postfix expression: not enough operands for " << token << endl;
-                    exit(1);
-                }
-                LinkedBinaryTree rightTree = s.top();
-                s.pop();
-                LinkedBinaryTree leftTree = s.top();
-                s.pop();
-                LinkedBinaryTree T;
-                T.addRoot();
-                *T.root() = token;
-                // Attach left and right subtrees.
-                T._root->left = leftTree._root;
-                if (T._root->left != nullptr)
-                    T._root->left->par = T._root;
-                T._root->right = rightTree._root;
-                if (T._root->right != nullptr)
-                    T._root->right->par = T._root;
-                T.n = leftTree.n + rightTree.n + 1;
-                // Invalidate the old trees so they don't delete nodes in their destructor.
-                leftTree._root = nullptr; leftTree.n = 0;
-                rightTree._root = nullptr; rightTree.n = 0;
-                s.push(T);
+// Options given on the command line. With no arguments the program behaves
+// exactly as the assignment describes.
+struct Options {
+    string cacheDir;     // --cache DIR: reuse scores stored in DIR by earlier runs
+    string serveSocket;  // --serve PATH: load input.txt once and score expressions sent to socket PATH
+    string clientSocket; // --client PATH: send expressions from standard input to the server at PATH
+    bool pipeline = false; // --pipeline: overlap reading, scoring and printing (prints in file order)
+    int threads = 0;       // --threads N: worker threads (default: one per core)
+    string outputFile;     // --output FILE: write the results to FILE instead of standard output
+    long topK = -1;        // --top-k K: print only the K highest scoring trees
+    bool prune = false;    // --prune: with --top-k, skip trees whose bounds show they cannot make the top K
+    bool race = false;     // --race: with --top-k, select by racing trees on growing row samples (approximate)
+    double confidence = 3; // --confidence Z: confidence interval half width in standard errors for --race
+    uint64_t seed = 1;     // --seed S: random seed for sampling
+    bool hoist = false;    // --hoist: compute subtrees that are constant along runs of rows once per run
+    string grid;           // --grid SPEC: score over a generated grid (e.g. "b=0:1:11,a=0:1:101") instead of input.txt
+    bool dedup = false;    // --dedup: evaluate each distinct input row once, weighted by its count
+    bool stats = false;    // --stats: print the statistics of each tree's outputs
+    string rankBy = "mean"; // --rank-by STAT: with --stats, rank by this statistic (see statNames)
+    int procs = 0;         // --procs N: score in N worker processes
+    bool shardRows = false; // --shard-by rows: give each worker process a share of the rows, not of the expressions
+    size_t sortMemory = 0; // --sort-memory MB: sort out of core, holding about MB megabytes of results in memory
+    bool stableSort = false; // --stable-sort: rank in parallel, breaking ties by node count and then file order
+    bool simplify = false; // --simplify: evaluate algebraically simplified copies of the trees
+    bool reassociate = false; // --reassociate: evaluate copies with balanced + and * chains (results may round differently)
+    int generations = -1;  // --evolve G: evolve the trees for G generations and print the final population
+    size_t population = 500; // --population N: trees per generation when evolving
+    int tournament = 7;    // --tournament K: trees compared to pick each parent when evolving
+    string precision = "double"; // --precision float|double|long-double: type the trees are evaluated in
+    string convertTo;      // --convert FILE: write input.txt as a binary columnar file and exit
+    bool float32 = false;  // --float32: with --convert, store the values as 32-bit floats
+    bool checksums = false; // --checksums: with --convert, store a checksum of every column
+    double compressError = -1; // --compress E: score from 16-bit quantized columns, each value within E
+    bool blocked = false;  // --blocked: evaluate all trees on each cache-sized tile of rows in turn
+    int tuneSteps = 0;     // --tune N: raise each tree's score by N steps of gradient ascent on its literals
+    bool pareto = false;   // --pareto: print the Pareto fronts of score against tree size
+    size_t fronts = SIZE_MAX; // --fronts F: with --pareto, print only the first F fronts
+    string checkpoint;     // --checkpoint FILE: save the scoring progress to FILE as it goes
+    double checkpointEvery = 60; // --checkpoint-every S: seconds between checkpoints
+    bool resume = false;   // --resume: with --checkpoint, continue from the progress saved in FILE
+};
+
+Options parseOptions(int argc, char* argv[]) {
+    Options opts;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--cache" && i + 1 < argc) {
+            opts.cacheDir = argv[++i];
+        } else if (arg == "--serve" && i + 1 < argc) {
+            opts.serveSocket = argv[++i];
+        } else if (arg == "--client" && i + 1 < argc) {
+            opts.clientSocket = argv[++i];
+        } else if (arg == "--pipeline") {
+            opts.pipeline = true;
+        } else if (arg == "--threads" && i + 1 < argc) {
+            opts.threads = atoi(argv[++i]);
+        } else if (arg == "--output" && i + 1 < argc) {
+            opts.outputFile = argv[++i];
+        } else if (arg == "--top-k" && i + 1 < argc) {
+            opts.topK = atol(argv[++i]);
+        } else if (arg == "--prune") {
+            opts.prune = true;
+        } else if (arg == "--race") {
+            opts.race = true;
+        } else if (arg == "--confidence" && i + 1 < argc) {
+            opts.confidence = atof(argv[++i]);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            opts.seed = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--hoist") {
+            opts.hoist = true;
+        } else if (arg == "--grid" && i + 1 < argc) {
+            opts.grid = argv[++i];
+        } else if (arg == "--dedup") {
+            opts.dedup = true;
+        } else if (arg == "--procs" && i + 1 < argc) {
+            opts.procs = atoi(argv[++i]);
+        } else if (arg == "--shard-by" && i + 1 < argc) {
+            string by = argv[++i];
+            if (by != "rows" && by != "expressions") {
+                cerr << "--shard-by takes rows or expressions" << endl;
+                exit(1);
+            }
+            opts.shardRows = (by == "rows");
+        } else if (arg == "--sort-memory" && i + 1 < argc) {
+            opts.sortMemory = max(1.0, atof(argv[++i])) * (1 << 20);
+        } else if (arg == "--stable-sort") {
+            opts.stableSort = true;
+        } else if (arg == "--reassociate") {
+            opts.reassociate = true;
+        } else if (arg == "--evolve" && i + 1 < argc) {
+            opts.generations = atoi(argv[++i]);
+        } else if (arg == "--population" && i + 1 < argc) {
+            opts.population = max(1, atoi(argv[++i]));
+        } else if (arg == "--tournament" && i + 1 < argc) {
+            opts.tournament = max(1, atoi(argv[++i]));
+        } else if (arg == "--precision" && i + 1 < argc) {
+            opts.precision = argv[++i];
+            if (opts.precision != "float" && opts.precision != "double" && opts.precision != "long-double") {
+                cerr << "--precision takes float, double or long-double" << endl;
+                exit(1);
+            }
+        } else if (arg == "--convert" && i + 1 < argc) {
+            opts.convertTo = argv[++i];
+        } else if (arg == "--float32") {
+            opts.float32 = true;
+        } else if (arg == "--checksums") {
+            opts.checksums = true;
+        } else if (arg == "--compress" && i + 1 < argc) {
+            opts.compressError = max(0.0, atof(argv[++i]));
+        } else if (arg == "--blocked") {
+            opts.blocked = true;
+        } else if (arg == "--tune" && i + 1 < argc) {
+            opts.tuneSteps = max(0, atoi(argv[++i]));
+        } else if (arg == "--pareto") {
+            opts.pareto = true;
+        } else if (arg == "--fronts" && i + 1 < argc) {
+            opts.fronts = max(0, atoi(argv[++i]));
+        } else if (arg == "--checkpoint" && i + 1 < argc) {
+            opts.checkpoint = argv[++i];
+        } else if (arg == "--checkpoint-every" && i + 1 < argc) {
+            opts.checkpointEvery = max(0.0, atof(argv[++i]));
+        } else if (arg == "--resume") {
+            opts.resume = true;
+        } else if (arg == "--simplify") {
+            opts.simplify = true;
+        } else if (arg == "--stats") {
+            opts.stats = true;
+        } else if (arg == "--rank-by" && i + 1 < argc) {
+            opts.rankBy = argv[++i];
+            if (find(statNames.begin(), statNames.end(), opts.rankBy) == statNames.end()) {
+                cerr << "Unknown statistic " << opts.rankBy << endl;
+                exit(1);
             }
         } else {
-            // Token is an operand: either a variable ("a" or "b") or a numeric literal.
-            LinkedBinaryTree T;
-            T.addRoot();
-            *T.root() = token;
-            T.n = 1;
-            s.push(T);
+            cerr << "Unknown or incomplete option: " << arg << endl;
+            cerr << "Usage: " << argv[0] << " [--cache DIR] [--serve PATH | --client PATH]"
+                 << " [--pipeline] [--threads N] [--output FILE]"
+                 << " [--top-k K [--prune | --race [--confidence Z] [--seed S]]]"
+                 << " [--hoist] [--grid SPEC] [--dedup] [--stats [--rank-by STAT]]"
+                 << " [--procs N [--shard-by rows|expressions]] [--sort-memory MB] [--stable-sort] [--simplify] [--reassociate]"
+                 << " [--evolve G [--population N] [--tournament K]] [--pareto [--fronts F]]"
+                 << " [--tune N] [--precision float|double|long-double]"
+                 << " [--convert FILE [--float32] [--checksums]] [--compress E] [--blocked]"
+                 << " [--checkpoint FILE [--checkpoint-every S] [--resume]]" << endl;
+            exit(1);
         }
     }
-    if (s.size() != 1) {
-        cerr << "Invalid postfix expression: remaining trees in stack" << endl;
+    if ((opts.prune || opts.race) && opts.topK < 0) {
+        cerr << "--prune and --race need --top-k" << endl;
+        exit(1);
+    }
+    // The external sort scores the trees through TreeScorer as it reads them and prints them by
+    // score, so the options handled after it would be quietly dropped.
+    if (opts.sortMemory > 0 && (opts.topK >= 0 || opts.stats || opts.procs > 0 || opts.generations >= 0
+                                || opts.pareto || opts.tuneSteps > 0 || opts.precision != "double"
+                                || opts.stableSort || opts.blocked)) {
+        cerr << "--sort-memory cannot be combined with --top-k, --stats, --procs, --evolve, --pareto, --tune,"
+             << " --precision, --stable-sort or --blocked" << endl;
+        exit(1);
+    }
+    // The worker processes only compile and evaluate the trees, on input.txt or on the rows read
+    // here; every other scoring option would be quietly dropped, so those combinations are refused.
+    if (opts.procs > 0 && (!opts.grid.empty() || !opts.cacheDir.empty() || opts.simplify || opts.hoist
+                           || opts.compressError >= 0 || opts.reassociate || opts.blocked)) {
+        cerr << "--procs cannot be combined with --grid, --cache, --simplify, --hoist, --compress,"
+             << " --reassociate or --blocked" << endl;
+        exit(1);
+    }
+    if (opts.procs > 0 && (opts.topK >= 0 || opts.stats || opts.pareto || opts.generations >= 0
+                           || opts.precision != "double")) {
+        cerr << "--procs cannot be combined with --top-k, --stats, --pareto, --evolve or --precision" << endl;
+        exit(1);
+    }
+    if (opts.procs > 0 && opts.shardRows && opts.dedup) {
+        cerr << "--shard-by rows cannot be combined with --dedup" << endl;
+        exit(1);
+    }
+    // --precision scores the trees itself, in the chosen type and then in double to compare the two,
+    // without TreeScorer; the modes handled before it never look at it.
+    if (opts.precision != "double" && (!opts.cacheDir.empty() || opts.simplify || opts.hoist
+                                       || opts.compressError >= 0 || opts.reassociate || opts.blocked)) {
+        cerr << "--precision cannot be combined with --cache, --simplify, --hoist, --compress, --reassociate"
+             << " or --blocked" << endl;
+        exit(1);
+    }
+    if (opts.precision != "double" && (opts.topK >= 0 || opts.stats || opts.pareto || opts.generations >= 0)) {
+        cerr << "--precision cannot be combined with --top-k, --stats, --pareto or --evolve" << endl;
+        exit(1);
+    }
+    // --pipeline scores every tree plainly as it is read and prints in file order, so options that
+    // change how the trees are scored, selected or ranked would be quietly dropped.
+    if (opts.pipeline && (opts.topK >= 0 || opts.stats || !opts.cacheDir.empty() || opts.dedup || !opts.grid.empty()
+                          || opts.simplify || opts.hoist || opts.compressError >= 0 || opts.reassociate
+                          || opts.blocked)) {
+        cerr << "--pipeline cannot be combined with --top-k, --stats, --cache, --dedup, --grid, --simplify,"
+             << " --hoist, --compress, --reassociate or --blocked" << endl;
+        exit(1);
+    }
+    if (opts.pipeline && (opts.stableSort || opts.procs > 0 || opts.sortMemory > 0 || opts.generations >= 0
+                          || opts.pareto || opts.tuneSteps > 0 || opts.precision != "double")) {
+        cerr << "--pipeline cannot be combined with --stable-sort, --procs, --sort-memory, --evolve, --pareto,"
+             << " --tune or --precision" << endl;
+        exit(1);
+    }
+    if (opts.resume && opts.checkpoint.empty()) {
+        cerr << "--resume needs --checkpoint" << endl;
         exit(1);
     }
-    return s.top();
+    if (!opts.checkpoint.empty() && (opts.topK >= 0 || opts.stats || opts.procs > 0 || opts.sortMemory > 0
+                                     || opts.generations >= 0 || opts.pipeline || opts.precision != "double")) {
+        cerr << "--checkpoint cannot be combined with --top-k, --stats, --procs, --sort-memory, --evolve,"
+             << " --pipeline or --precision" << endl;
+        exit(1);
+    }
+    if (opts.threads <= 0)
+        opts.threads = max(1u, thread::hardware_concurrency());
+    return opts;
 }
 
 //*****************************************************
 // Main Function (from the Assignment)
 
+// Scores trees on all input rows, as the assignment describes. With --cache, scores computed by
+// earlier runs on the same input are reused. With --grid the rows come from the grid instead of
+// data, with --hoist invariant subtrees are computed once per run, and with --simplify a simplified
+// copy of each tree is evaluated.
+class TreeScorer {
+public:
+    TreeScorer(const Dataset& data, const vector<GridAxis>& grid, const Options& opts);
+    ~TreeScorer();
+    void score(LinkedBinaryTree& t); // sets the tree's score
+    bool canBlock() const { return grid.empty() && !hoist && compressed == nullptr; }
+    void scoreBlocked(vector<LinkedBinaryTree>& trees); // scores them all, row tile by row tile (needs canBlock)
+    void scoreCheckpointed(vector<LinkedBinaryTree>& trees, Checkpoint& checkpoint); // scores the trees not yet done
+private:
+    bool lookup(LinkedBinaryTree& t, uint64_t& key); // sets the score from the cache if it is there
+    const LinkedBinaryTree& prepare(const LinkedBinaryTree& t, LinkedBinaryTree& simple); // the tree to evaluate
+    double evaluate(const LinkedBinaryTree& e);      // the score of e on the grid or rows
+    void timeReassociation(const LinkedBinaryTree& before, const LinkedBinaryTree& after);
+    const Dataset& data;
+    const vector<GridAxis>& grid;
+    ScoreCache* cache = nullptr;
+    RunLayout runs;
+    bool hoist;
+    bool simplify;
+    bool reassociate;
+    CompressedColumns* compressed = nullptr; // with --compress
+    vector<Interval> domain;   // range of each column, for simplifying
+    size_t nodesBefore = 0, nodesAfter = 0;
+    long heightBefore = 0, heightAfter = 0; // summed over the trees, when reassociating
+    size_t evaluated = 0;      // trees evaluated (not found in the cache)
+    static const size_t TIME_EVERY = 8; // with --reassociate, every 8th tree is also timed unbalanced
+    size_t timed = 0;          // trees timed both ways
+    double secondsBefore = 0, secondsAfter = 0; // their evaluation time, unbalanced and rebalanced
+};
+
+TreeScorer::TreeScorer(const Dataset& data, const vector<GridAxis>& grid, const Options& opts)
+    : data(data), grid(grid), hoist(opts.hoist && grid.empty()), simplify(opts.simplify),
+      reassociate(opts.reassociate) {
+    // Scores from compressed columns differ with the error bound, so it is part of the cache key.
+    bool compress = opts.compressError >= 0 && grid.empty() && !hoist;
+    uint64_t key = grid.empty() ? hashDataset(data) : hashGrid(grid);
+    if (compress) {
+        uint64_t bits;
+        memcpy(&bits, &opts.compressError, sizeof(bits));
+        key = hashCombine(key, bits);
+    }
+    // Reassociated trees may round differently, so their scores are kept apart from exact ones.
+    if (reassociate)
+        key = hashCombine(key, hashString("reassociate"));
+    // So are simplified ones, since the simplifier is only exact on the domain it is given.
+    if (simplify)
+        key = hashCombine(key, hashString("simplify"));
+    if (!opts.cacheDir.empty())
+        cache = new ScoreCache(opts.cacheDir, key);
+    if (compress) {
+        compressed = new CompressedColumns(data, opts.compressError);
+        cerr << "Compressed the input to " << compressed->ratio() * 100 << "% of its size ("
+             << compressed->quantizedBlocks() << " of " << compressed->totalBlocks() << " blocks quantized)" << endl;
+    }
+    if (hoist) {
+        runs = findRuns(data);
+        size_t count = runs.starts.size() - 1;
+        // Runs of one or two rows leave nothing worth hoisting.
+        if (count * 2 > data.rows())
+            hoist = false;
+        cerr << "Hoisting " << (hoist ? "on" : "off") << ": " << data.rows() << " rows in " << count
+             << " runs along column " << (runs.inner >= 0 ? data.names[runs.inner] : "-") << endl;
+    }
+    // Grid values are finite, which is all the simplifier needs to know about them.
+    // Compressed values decode to within the error bound of the originals, which can be outside
+    // the range of the column, so the domain is widened by the bound (and a step for rounding).
+    if (simplify) {
+        for (size_t c = 0; c < data.names.size(); c++) {
+            Interval d = grid.empty() ? columnDomain(data.columns[c]) : unboundedInterval(false);
+            if (compressed != nullptr) {
+                d.lo = nextafter(d.lo - opts.compressError, -numeric_limits<double>::infinity());
+                d.hi = nextafter(d.hi + opts.compressError, numeric_limits<double>::infinity());
+            }
+            domain.push_back(d);
+        }
+    }
+}
+
+TreeScorer::~TreeScorer() {
+    delete compressed;
+    if (simplify)
+        cerr << "Simplified " << nodesBefore << " nodes to " << nodesAfter << endl;
+    if (reassociate && evaluated > 0) {
+        size_t rows = data.rows();
+        if (!grid.empty()) {
+            rows = 1;
+            for (auto& axis : grid)
+                rows *= axis.n;
+        }
+        cerr << "Reassociated: average depth " << double(heightBefore) / evaluated << " -> "
+             << double(heightAfter) / evaluated;
+        if (timed > 0)
+            cerr << ", " << timed * rows / secondsBefore / 1e6 << " -> " << timed * rows / secondsAfter / 1e6
+                 << " million tree-rows per second (timed on " << timed << " trees)";
+        cerr << endl;
+    }
+    if (cache != nullptr) {
+        cache->flush();
+        delete cache;
+    }
+}
+
+bool TreeScorer::lookup(LinkedBinaryTree& t, uint64_t& key) {
+    key = 0;
+    double cached;
+    if (cache == nullptr)
+        return false;
+    key = t.canonicalHash();
+    if (!cache->lookup(key, cached))
+        return false;
+    t.setScore(cached);
+    return true;
+}
+
+// Returns t, or with --simplify or --reassociate the transformed copy of it made in simple.
+const LinkedBinaryTree& TreeScorer::prepare(const LinkedBinaryTree& t, LinkedBinaryTree& simple) {
+    evaluated++;
+    if (!simplify && !reassociate)
+        return t;
+    // Only the sum of the values is used, so the sign of a zero value does not matter.
+    simple = t;
+    if (simplify) {
+        simple.simplify(domain, false);
+        nodesBefore += t.size();
+        nodesAfter += simple.size();
+    }
+    if (reassociate) {
+        LinkedBinaryTree before;
+        bool time = evaluated % TIME_EVERY == 0; // not the first tree, which warms up the evaluator
+        if (time)
+            before = simple;
+        heightBefore += simple.height();
+        simple.rebalance();
+        heightAfter += simple.height();
+        if (time)
+            timeReassociation(before, simple);
+    }
+    return simple;
+}
+
+double TreeScorer::evaluate(const LinkedBinaryTree& e) {
+    if (!grid.empty())
+        return scoreGrid(CompiledExpression(e, grid.size() - 1), grid);
+    if (hoist)
+        return scoreRuns(CompiledExpression(e, runs.inner), data, runs);
+    if (compressed != nullptr)
+        return CompiledExpression(e).scoreCompressed(*compressed, data);
+    return CompiledExpression(e).score(data);
+}
+
+// Scores a tree before and after rebalancing and adds up the time each took, for the report.
+void TreeScorer::timeReassociation(const LinkedBinaryTree& before, const LinkedBinaryTree& after) {
+    auto t0 = chrono::steady_clock::now();
+    volatile double sink = evaluate(before);
+    auto t1 = chrono::steady_clock::now();
+    sink = evaluate(after);
+    auto t2 = chrono::steady_clock::now();
+    (void)sink;
+    secondsBefore += chrono::duration<double>(t1 - t0).count();
+    secondsAfter += chrono::duration<double>(t2 - t1).count();
+    timed++;
+}
+
+void TreeScorer::score(LinkedBinaryTree& t) {
+    uint64_t key;
+    if (lookup(t, key))
+        return;
+    LinkedBinaryTree simple;
+    t.setScore(evaluate(prepare(t, simple)));
+    if (cache != nullptr)
+        cache->insert(key, t.getScore());
+}
+
 //
-// This main function reads postfix expressions from "expressions.txt" and input values from "input.txt".
-// It then builds the expression trees, evaluates them with all provided <a, b> pairs,
-// computes an average score for each tree, sorts the trees by score, and prints the results.
+// Scores the trees a tile at a time. Within a tile of trees, the rows are taken in tiles small
+// enough to stay in cache, and every tree of the tile is run over a row tile before the next one
+// is loaded, so the input streams from memory once per tile of trees instead of once per tree.
+// Each tree still adds up its outputs block by block in row order, so the scores are identical
+// to scoring the trees one at a time.
+void TreeScorer::scoreBlocked(vector<LinkedBinaryTree>& trees) {
+    const size_t BLOCK = CompiledExpression::BLOCK;
+    const size_t TREE_TILE = 4096;          // compiled trees held at once
+    const size_t CACHE_BYTES = 256 * 1024;  // input bytes per row tile
+    size_t tileRows = max(BLOCK, CACHE_BYTES / (sizeof(double) * max<size_t>(1, data.columns.size())) / BLOCK * BLOCK);
+    double out[BLOCK];
+    for (size_t first = 0; first < trees.size(); first += TREE_TILE) {
+        vector<size_t> pending;
+        vector<uint64_t> keys;
+        vector<CompiledExpression> programs;
+        for (size_t i = first; i < min(trees.size(), first + TREE_TILE); i++) {
+            uint64_t key;
+            if (lookup(trees[i], key))
+                continue;
+            LinkedBinaryTree simple;
+            programs.push_back(CompiledExpression(prepare(trees[i], simple)));
+            pending.push_back(i);
+            keys.push_back(key);
+        }
+        vector<double> sums(programs.size(), 0);
+        for (size_t tile = 0; tile < data.rows(); tile += tileRows) {
+            size_t end = min(data.rows(), tile + tileRows);
+            for (size_t k = 0; k < programs.size(); k++) {
+                for (size_t start = tile; start < end; start += BLOCK) {
+                    size_t m = min(BLOCK, end - start);
+                    programs[k].evaluateRange(data, start, m, out);
+                    addOutputs(data, start, m, out, sums[k]);
+                }
+            }
+        }
+        for (size_t k = 0; k < pending.size(); k++) {
+            trees[pending[k]].setScore(sums[k] / data.count());
+            if (cache != nullptr)
+                cache->insert(keys[k], sums[k] / data.count());
+        }
+    }
+}
+
+//
+// Scores the trees after those the checkpoint has, saving progress along the way. On plain rows a
+// tree is summed a block at a time, exactly as CompiledExpression::score does, so a checkpoint can
+// fall between any two blocks; grid, hoisted and compressed scoring are checkpointed between trees.
+void TreeScorer::scoreCheckpointed(vector<LinkedBinaryTree>& trees, Checkpoint& checkpoint) {
+    const size_t BLOCK = CompiledExpression::BLOCK;
+    double out[BLOCK];
+    for (size_t i = checkpoint.scores.size(); i < trees.size(); i++) {
+        LinkedBinaryTree& t = trees[i];
+        uint64_t key;
+        if (!canBlock()) {
+            score(t);
+        } else if (!lookup(t, key)) {
+            LinkedBinaryTree simple;
+            CompiledExpression code(prepare(t, simple));
+            while (checkpoint.row < data.rows()) {
+                size_t m = min(BLOCK, data.rows() - checkpoint.row);
+                code.evaluateRange(data, checkpoint.row, m, out);
+                addOutputs(data, checkpoint.row, m, out, checkpoint.sum);
+                checkpoint.row += m;
+                checkpoint.tick();
+            }
+            t.setScore(checkpoint.sum / data.count());
+            if (cache != nullptr)
+                cache->insert(key, t.getScore());
+        }
+        checkpoint.finishTree(t.getScore());
+        checkpoint.tick();
+    }
+}
+
+// Identifies a checkpointed run by everything its scores depend on: the rows, the trees in
+// order, and the options that change how they are evaluated.
+uint64_t runKey(const vector<LinkedBinaryTree>& trees, const Dataset& data, const vector<GridAxis>& grid,
+                const Options& opts) {
+    uint64_t key = grid.empty() ? hashDataset(data) : hashGrid(grid);
+    for (auto& t : trees)
+        key = hashCombine(key, t.canonicalHash());
+    uint64_t bits;
+    memcpy(&bits, &opts.compressError, sizeof(bits));
+    key = hashCombine(key, bits);
+    return hashCombine(key, opts.hoist | opts.simplify << 1 | opts.reassociate << 2);
+}
+
+// Evaluate each expression tree on all input rows,
+// compute the average, and store it as the tree's score.
+void scoreTrees(vector<LinkedBinaryTree>& trees, const Dataset& data, const vector<GridAxis>& grid,
+                const Options& opts) {
+    TreeScorer scorer(data, grid, opts);
+    if (!opts.checkpoint.empty()) {
+        Checkpoint checkpoint(opts.checkpoint, opts.checkpointEvery, runKey(trees, data, grid, opts));
+        if (opts.resume) {
+            if (checkpoint.load())
+                cerr << "Resuming after " << checkpoint.scores.size() << " of " << trees.size() << " trees" << endl;
+            else
+                cerr << "No checkpoint " << opts.checkpoint << "; starting from the beginning" << endl;
+        }
+        for (size_t i = 0; i < checkpoint.scores.size(); i++)
+            trees[i].setScore(checkpoint.scores[i]);
+        scorer.scoreCheckpointed(trees, checkpoint);
+        checkpoint.save();
+        return;
+    }
+    if (opts.blocked && scorer.canBlock()) {
+        scorer.scoreBlocked(trees);
+        return;
+    }
+    for (auto& t : trees)
+        scorer.score(t);
+}
+
+//*****************************************************
+// External Sorting
+
 //
-// NOTE: Make sure "expressions.txt" and "input.txt" are in the same working directory as the executable.
-int main() {
-    // Read postfix expressions into vector
+// With --sort-memory, trees are scored one at a time as expressions.txt is read, so the trees are
+// never all in memory. Their result lines are collected with their scores until the collected
+// records reach the memory budget; the records are then sorted and spilled as a run to an unlinked
+// temporary file. The runs are finally merged with a heap and written out. Records are ordered by
+// score, then by position in expressions.txt, with NaN scores last.
+// Run file record: score (8 bytes), position (8 bytes), line length (4 bytes), line text.
+
+struct SortRecord {
+    double score;
+    uint64_t index;
+    string line;
+};
+
+bool recordBefore(double s1, uint64_t i1, double s2, uint64_t i2) {
+    if (isnan(s1) || isnan(s2)) {
+        if (isnan(s1) && isnan(s2))
+            return i1 < i2;
+        return isnan(s2);
+    }
+    return s1 < s2 || (s1 == s2 && i1 < i2);
+}
+
+// Opens an anonymous temporary file in $TMPDIR (or /tmp) that disappears when it is closed.
+FILE* openRunFile() {
+    const char* dir = getenv("TMPDIR");
+    string path = string(dir != nullptr ? dir : "/tmp") + "/ass4-run-XXXXXX";
+    int fd = mkstemp(path.data());
+    if (fd < 0) {
+        perror(path.c_str());
+        exit(1);
+    }
+    unlink(path.c_str());
+    return fdopen(fd, "w+b");
+}
+
+// Appends one record to a run file.
+void writeRecord(FILE* f, const SortRecord& r) {
+    uint32_t len = r.line.size();
+    if (fwrite(&r.score, sizeof(r.score), 1, f) != 1 || fwrite(&r.index, sizeof(r.index), 1, f) != 1
+        || fwrite(&len, sizeof(len), 1, f) != 1 || fwrite(r.line.data(), 1, len, f) != len) {
+        perror("Writing sort run");
+        exit(1);
+    }
+}
+
+// Flushes a finished run file and positions it at its start for reading.
+void finishRun(FILE* f) {
+    if (fflush(f) != 0) {
+        perror("Writing sort run");
+        exit(1);
+    }
+    rewind(f);
+}
+
+// Sorts the records and writes them to a new run file, which is left positioned at its start.
+// The records are cleared but keep their capacity, which the budget already counts.
+FILE* spillRun(vector<SortRecord>& records) {
+    sort(records.begin(), records.end(), [](const SortRecord& x, const SortRecord& y) {
+        return recordBefore(x.score, x.index, y.score, y.index);
+    });
+    FILE* f = openRunFile();
+    for (const auto& r : records)
+        writeRecord(f, r);
+    finishRun(f);
+    records.clear();
+    return f;
+}
+
+// Reads the next record of a run, returning false at its end.
+bool readRecord(FILE* f, SortRecord& r) {
+    uint32_t len;
+    if (fread(&r.score, sizeof(r.score), 1, f) != 1)
+        return false;
+    if (fread(&r.index, sizeof(r.index), 1, f) != 1 || fread(&len, sizeof(len), 1, f) != 1) {
+        cerr << "Corrupt sort run" << endl;
+        exit(1);
+    }
+    r.line.resize(len);
+    if (fread(r.line.data(), 1, len, f) != len) {
+        cerr << "Corrupt sort run" << endl;
+        exit(1);
+    }
+    return true;
+}
+
+// Merges the runs with a heap, reading each through a buffer of bufSize bytes, and passes their
+// records to emit in order. Returns false as soon as emit does; the runs are closed either way.
+bool mergeRuns(const vector<FILE*>& runs, size_t bufSize, const function<bool(const SortRecord&)>& emit) {
+    vector<SortRecord> heads(runs.size());
+    auto later = [&](size_t x, size_t y) {
+        return recordBefore(heads[y].score, heads[y].index, heads[x].score, heads[x].index);
+    };
+    priority_queue<size_t, vector<size_t>, decltype(later)> heap(later);
+    for (size_t i = 0; i < runs.size(); i++) {
+        setvbuf(runs[i], nullptr, _IOFBF, bufSize);
+        if (readRecord(runs[i], heads[i]))
+            heap.push(i);
+    }
+    bool ok = true;
+    while (ok && !heap.empty()) {
+        size_t i = heap.top();
+        heap.pop();
+        ok = emit(heads[i]);
+        if (readRecord(runs[i], heads[i]))
+            heap.push(i);
+    }
+    for (FILE* f : runs)
+        fclose(f);
+    return ok;
+}
+
+// Scores the expressions in expressions.txt and writes their result lines to fd, sorted by score,
+// keeping the memory used for records, file buffers and output within about opts.sortMemory bytes.
+// While collecting, the budget counts the whole capacity of the record vector (including the
+// copy made while it grows) and of every line. When merging, a quarter of the budget holds the
+// output and the rest is split between the file buffers. At least MIN_BUFFER bytes go to each
+// buffer, so with more runs than that allows they are merged in several passes, each pass merging
+// groups of runs into longer runs.
+int runExternalSort(const Dataset& data, const vector<GridAxis>& grid, const Options& opts, int fd) {
+    const size_t MIN_BUFFER = 1 << 16;
+    TreeScorer scorer(data, grid, opts);
+    vector<SortRecord> records;
+    vector<FILE*> runs;
+    size_t lineBytes = 0; // capacity of the lines held in records
+    uint64_t index = 0;
+    ifstream exp_file("expressions.txt");
+    string line;
+    while (getline(exp_file, line)) {
+        if (line.empty()) continue;
+        LinkedBinaryTree t = createExpressionTree(line, data.names);
+        scorer.score(t);
+        SortRecord r{t.getScore(), index++, string()};
+        appendResultLine(r.line, t);
+        // Growing the vector briefly holds the old and the new array.
+        size_t cap = records.capacity();
+        size_t arrays = records.size() < cap ? cap : cap + max<size_t>(1, 2 * cap);
+        if (!records.empty() && arrays * sizeof(SortRecord) + lineBytes + r.line.capacity() > opts.sortMemory) {
+            runs.push_back(spillRun(records));
+            lineBytes = 0;
+        }
+        lineBytes += r.line.capacity();
+        records.push_back(move(r));
+    }
+    exp_file.close();
+
+    string out;
+    size_t outLimit = min<size_t>(1 << 20, opts.sortMemory / 4);
+    auto emit = [&](const SortRecord& r) {
+        out += r.line;
+        if (out.size() < outLimit)
+            return true;
+        bool ok = writeAll(fd, out);
+        out.clear();
+        return ok;
+    };
+
+    // Everything fit in memory: no merge needed.
+    if (runs.empty()) {
+        sort(records.begin(), records.end(), [](const SortRecord& x, const SortRecord& y) {
+            return recordBefore(x.score, x.index, y.score, y.index);
+        });
+        for (const auto& r : records)
+            if (!emit(r)) return 1;
+        return writeAll(fd, out) ? 0 : 1;
+    }
+    if (!records.empty())
+        runs.push_back(spillRun(records));
+    vector<SortRecord>().swap(records);
+    cerr << "Merging " << runs.size() << " sorted runs of " << index << " trees" << endl;
+
+    // A pass reads fanIn runs and writes one, each through its own buffer.
+    size_t bufferBytes = opts.sortMemory - outLimit;
+    size_t fanIn = max<size_t>(2, bufferBytes / MIN_BUFFER - 1);
+    size_t passes = 0;
+    while (runs.size() > fanIn) {
+        vector<FILE*> merged;
+        for (size_t first = 0; first < runs.size(); first += fanIn) {
+            vector<FILE*> group(runs.begin() + first, runs.begin() + min(runs.size(), first + fanIn));
+            if (group.size() == 1) {
+                merged.push_back(group[0]);
+                continue;
+            }
+            size_t bufSize = max(MIN_BUFFER, bufferBytes / (group.size() + 1));
+            FILE* f = openRunFile();
+            setvbuf(f, nullptr, _IOFBF, bufSize);
+            mergeRuns(group, bufSize, [f](const SortRecord& r) { writeRecord(f, r); return true; });
+            finishRun(f);
+            merged.push_back(f);
+        }
+        runs.swap(merged);
+        passes++;
+    }
+    if (passes > 0)
+        cerr << "Merged down to " << runs.size() << " runs in " << passes << " passes" << endl;
+    if (!mergeRuns(runs, max(MIN_BUFFER, bufferBytes / runs.size()), emit))
+        return 1;
+    return writeAll(fd, out) ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+    Options opts = parseOptions(argc, argv);
+    if (!opts.convertTo.empty())
+        return convertInput("input.txt", opts.convertTo, opts.float32, opts.checksums);
+    if (!opts.clientSocket.empty())
+        return runClient(opts.clientSocket);
+    if (!opts.serveSocket.empty())
+        return runServer(opts.serveSocket, opts.dedup ? deduplicate(readDataset("input.txt"))
+                                                      : readDataset("input.txt"));
+
+    // Results go to standard output unless --output names a file.
+    int out_fd = 1;
+    if (!opts.outputFile.empty()) {
+        out_fd = open(opts.outputFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (out_fd < 0) {
+            perror(opts.outputFile.c_str());
+            return 1;
+        }
+    }
+    if (opts.pipeline)
+        return runPipeline(opts.threads, out_fd);
+
+    // Read the input data into columns. The header line, if any, names the variables.
+    // With --grid the rows are generated instead, and only the variable names are needed here.
+    // When worker processes shard the rows, each one reads its own rows later.
+    Dataset data;
+    vector<GridAxis> grid;
+    bool workersReadRows = opts.procs > 0 && opts.shardRows && opts.tuneSteps == 0;
+    if (workersReadRows) {
+        data.names = readColumnNames("input.txt");
+    } else if (opts.grid.empty()) {
+        data = readDataset("input.txt");
+        if (opts.dedup) {
+            size_t before = data.rows();
+            data = deduplicate(data);
+            cerr << "Deduplicated " << before << " input rows to " << data.rows() << " distinct rows" << endl;
+        }
+    } else {
+        grid = parseGrid(opts.grid);
+        data.names = gridNames(grid);
+    }
+
+    // With --sort-memory, the trees are scored and sorted without holding them all.
+    if (opts.sortMemory > 0) {
+        int status = runExternalSort(data, grid, opts, out_fd);
+        if (status != 0)
+            cerr << "Could not write the results" << endl;
+        return status;
+    }
+
+    // Read postfix expressions into vector, binding their variables to the input columns
     vector<LinkedBinaryTree> trees;
     ifstream exp_file("expressions.txt");
     string line;
     while (getline(exp_file, line)) {
         if(line.empty()) continue; // Skipping blank lines
-        trees.push_back(createExpressionTree(line));
+        trees.push_back(createExpressionTree(line, data.names));
     }
     exp_file.close();
 
-    // Read input data into a 2D vector (each inner vector contains a pair: a and b)
-    vector<vector<double> > inputs;
-    ifstream input_file("input.txt");
-    while (getline(input_file, line)) {
-        if(line.empty()) continue; // Skip empty lines
-        vector<double> ab_input;
-        stringstream ss(line);
-        string str;
-        while (getline(ss, str, ' ')) {
-            if (!str.empty())
-                ab_input.push_back(stod(str));
+    // With --evolve, the trees seed a genetic search and the final population is printed instead.
+    if (opts.generations >= 0) {
+        if (!grid.empty())
+            data = materializeGrid(grid);
+        trees = Evolver(data, opts.seed).run(trees, opts.population, opts.generations, opts.tournament,
+                                             opts.threads);
+        sort(trees.begin(), trees.end());
+        if (!writeResults(out_fd, trees, opts.threads)) {
+            cerr << "Could not write the results" << endl;
+            return 1;
         }
-        if(!ab_input.empty())
-            inputs.push_back(ab_input);
+        return 0;
     }
-    input_file.close();
 
-    // Evaluate each expression tree on all provided <a, b> pairs,
-    // compute the average, and store it as the tree's score.
-    for (auto& t : trees) {
-        double sum = 0;
-        for (auto& i : inputs) {
-            sum += t.evaluateExpression(i[0], i[1]);
-        }
-        t.setScore(sum / inputs.size());
+    // With --stats, every statistic of each tree's outputs is printed instead of just the score.
+    if (opts.stats) {
+        if (!grid.empty())
+            data = materializeGrid(grid);
+        return runStats(trees, data, opts.rankBy, opts.threads, out_fd);
     }
 
-    // Sort the trees by their score (lowest score first)
-    sort(trees.begin(), trees.end());
+    // With --tune, the literals of each tree are first adjusted to raise its score.
+    if (opts.tuneSteps > 0)
+        tuneTrees(trees, grid.empty() ? data : materializeGrid(grid), opts.tuneSteps, opts.threads);
+
+    // With --pareto, the trees are ranked on score and size together.
+    if (opts.pareto) {
+        scoreTrees(trees, data, grid, opts);
+        int status = runPareto(trees, opts.fronts, out_fd);
+        if (status != 0)
+            cerr << "Could not write the results" << endl;
+        return status;
+    }
+
+    vector<uint32_t> order;
+    if (opts.topK >= 0) {
+        // With --top-k, only the best K trees are kept (and with --prune or --race most others
+        // are never fully scored). These modes need the rows stored, so a grid is written out.
+        if (!grid.empty())
+            data = materializeGrid(grid);
+        if (opts.race)
+            trees = raceTopK(trees, data, opts.topK, opts.confidence, opts.seed);
+        else
+            trees = selectTopK(trees, data, opts.topK, opts.prune);
+    } else {
+        if (opts.precision != "double")
+            scoreInPrecision(trees, grid.empty() ? data : materializeGrid(grid), opts.precision, opts.threads);
+        else if (opts.procs > 0 && grid.empty())
+            scoreInProcesses(trees, data, "input.txt", opts.procs, opts.shardRows);
+        else
+            scoreTrees(trees, data, grid, opts);
+        // Sort the trees by their score (lowest score first)
+        if (opts.stableSort)
+            order = rankTrees(trees, opts.threads);
+        else
+            sort(trees.begin(), trees.end());
+    }
 
     // Print out each expression and its computed score.
-    for (auto& t : trees) {
-        cout << "Exp ";
-        t.printExpression();
-        cout << " Score " << t.getScore() << endl;
+    if (!writeResults(out_fd, trees, opts.threads, order.empty() ? nullptr : &order)) {
+        cerr << "Could not write the results" << endl;
+        return 1;
     }
+    if (out_fd != 1)
+        close(out_fd);
 
     return 0;
 }
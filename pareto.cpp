@@ -0,0 +1,57 @@
+#include "pareto.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+using namespace std;
+
+//*****************************************************
+// Pareto Fronts
+
+// Sorts the records by score and returns the front (from 0) of each record in the sorted order.
+vector<uint32_t> paretoFronts(vector<ParetoRecord>& recs) {
+    sort(recs.begin(), recs.end(), [](const ParetoRecord& x, const ParetoRecord& y) {
+        if (x.score != y.score) return x.score > y.score;
+        if (x.size != y.size) return x.size < y.size;
+        return x.index < y.index;
+    });
+    vector<uint32_t> front(recs.size());
+    vector<const ParetoRecord*> last; // last member of each front
+    auto dominates = [](const ParetoRecord* q, const ParetoRecord& r) {
+        return q->size < r.size || (q->size == r.size && q->score > r.score);
+    };
+    for (size_t i = 0; i < recs.size(); i++) {
+        size_t lo = 0, hi = last.size();
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (dominates(last[mid], recs[i]))
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo == last.size())
+            last.push_back(&recs[i]);
+        else
+            last[lo] = &recs[i];
+        front[i] = lo;
+    }
+    return front;
+}
+
+// Computes the crowding distance of each member of a front, given in order of decreasing score.
+vector<double> crowdingDistances(const vector<ParetoRecord>& members) {
+    size_t n = members.size();
+    vector<double> dist(n, 0);
+    if (n == 0) return dist;
+    dist[0] = dist[n - 1] = numeric_limits<double>::infinity();
+    double scoreRange = members[0].score - members[n - 1].score;
+    double sizeRange = double(members[0].size) - members[n - 1].size;
+    for (size_t i = 1; i + 1 < n; i++) {
+        if (scoreRange > 0 && isfinite(scoreRange))
+            dist[i] += (members[i - 1].score - members[i + 1].score) / scoreRange;
+        if (sizeRange > 0)
+            dist[i] += (double(members[i - 1].size) - members[i + 1].size) / sizeRange;
+    }
+    return dist;
+}
@@ -0,0 +1,31 @@
+#ifndef PARETO_H
+#define PARETO_H
+
+#include <cstdint>
+#include <vector>
+
+//
+// Pareto ranking of trees on two objectives at once: a higher score and a smaller size.
+// Part of the ass4 library, which main.cpp and the C API (ass4.h) are built on.
+//
+// A tree dominates another if it is at least as good on both and better on one. Front 1 holds the
+// trees nothing dominates, front 2 those only front 1 dominates, and so on. The fronts are found by
+// sorting compact records by score (highest first, smaller size first on ties) and placing each
+// record in the first front whose last member does not dominate it; those last members get smaller
+// in size from front to front, so a binary search finds the front and the whole sort is O(N log N).
+// Within a front, the crowding distance measures the gap between a tree's neighbours on both
+// objectives (infinite at the two ends), as in NSGA-II. NaN scores rank below every number.
+
+struct ParetoRecord {
+    double score;   // NaN replaced by -infinity
+    uint32_t size;  // node count
+    uint32_t index; // position in the tree list
+};
+
+// Sorts the records by score and returns the front (from 0) of each record in the sorted order.
+std::vector<uint32_t> paretoFronts(std::vector<ParetoRecord>& recs);
+
+// Computes the crowding distance of each member of a front, given in order of decreasing score.
+std::vector<double> crowdingDistances(const std::vector<ParetoRecord>& members);
+
+#endif